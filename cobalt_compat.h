@@ -118,6 +118,16 @@ static void *kvzalloc(size_t sz, gfp_t flags)
 }
 #endif
 
+/* BPF_PROG_RUN() was replaced by bpf_prog_run() and later removed */
+#if KERNEL_VERSION(5, 15, 0) > LINUX_VERSION_CODE
+#define bpf_prog_run(prog, ctx) BPF_PROG_RUN(prog, ctx)
+#endif
+
+/* BIG TCP raised GSO_MAX_SIZE; the 64 KiB limit is now GSO_LEGACY_MAX_SIZE */
+#if KERNEL_VERSION(5, 19, 0) > LINUX_VERSION_CODE
+#define GSO_LEGACY_MAX_SIZE GSO_MAX_SIZE
+#endif
+
 /* save the best till last
  * qdisc_tree_reduce_backlog appears in kernel from:
 3.16.37 onward
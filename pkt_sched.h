@@ -879,6 +879,24 @@ enum {
 	TCA_CAKE_ACK_FILTER,
 	TCA_CAKE_SPLIT_GSO,
 	TCA_CAKE_FWMARK,
+	TCA_CAKE_BPF_FD,
+	TCA_CAKE_BPF_ID,
+	TCA_CAKE_DSCP_MAP,
+	TCA_CAKE_TIN_PARAMS,
+	TCA_CAKE_HOST_RATE64,
+	TCA_CAKE_AUTORATE_ESTIMATOR,
+	TCA_CAKE_AUTORATE_EGRESS,
+	TCA_CAKE_AUTORATE_MIN64,
+	TCA_CAKE_AUTORATE_MAX64,
+	TCA_CAKE_AUTORATE_FEEDBACK_US,
+	TCA_CAKE_L4S,
+	TCA_CAKE_SCE,
+	TCA_CAKE_TIN_AQM,
+	TCA_CAKE_HEAD_DROP,
+	TCA_CAKE_HOST_MEM_PCT,
+	TCA_CAKE_COMPACT,
+	TCA_CAKE_MEMORY_PEAK_RESET,
+	TCA_CAKE_FLOW_KEYS,
 	__TCA_CAKE_MAX
 };
 #define TCA_CAKE_MAX	(__TCA_CAKE_MAX - 1)
@@ -901,10 +919,49 @@ enum {
 	TCA_CAKE_STATS_DROP_NEXT_US,
 	TCA_CAKE_STATS_P_DROP,
 	TCA_CAKE_STATS_BLUE_TIMER_US,
+	TCA_CAKE_STATS_COMPACTED,
+	TCA_CAKE_STATS_TRUESIZE_PCT,
+	TCA_CAKE_STATS_MEMORY_CURRENT,
+	TCA_CAKE_STATS_MEM_TOP_FLOWS,
+	TCA_CAKE_STATS_FLOW_KEY,
+	TCA_CAKE_STATS_MEM_TOP_HOSTS,
 	__TCA_CAKE_STATS_MAX
 };
 #define TCA_CAKE_STATS_MAX (__TCA_CAKE_STATS_MAX - 1)
 
+/* Entries of TCA_CAKE_STATS_MEM_TOP_FLOWS, largest first */
+enum {
+	__TCA_CAKE_MEM_FLOW_INVALID,
+	TCA_CAKE_MEM_FLOW_CLASSID,
+	TCA_CAKE_MEM_FLOW_MEMORY,
+	TCA_CAKE_MEM_FLOW_BACKLOG,
+	__TCA_CAKE_MEM_FLOW_MAX
+};
+#define TCA_CAKE_MEM_FLOW_MAX (__TCA_CAKE_MEM_FLOW_MAX - 1)
+
+/* Entries of TCA_CAKE_STATS_MEM_TOP_HOSTS, largest first */
+enum {
+	__TCA_CAKE_MEM_HOST_INVALID,
+	TCA_CAKE_MEM_HOST_TAG,
+	TCA_CAKE_MEM_HOST_DST,	/* tag is of a destination host */
+	TCA_CAKE_MEM_HOST_MEMORY,
+	__TCA_CAKE_MEM_HOST_MAX
+};
+#define TCA_CAKE_MEM_HOST_MAX (__TCA_CAKE_MEM_HOST_MAX - 1)
+
+/* Entries of TCA_CAKE_TIN_STATS_HEAVY_FLOWS, by bytes sent recently */
+enum {
+	__TCA_CAKE_HEAVY_FLOW_INVALID,
+	TCA_CAKE_HEAVY_FLOW_CLASSID,
+	TCA_CAKE_HEAVY_FLOW_TAG,
+	TCA_CAKE_HEAVY_FLOW_BYTES,
+	TCA_CAKE_HEAVY_FLOW_BACKLOG,
+	TCA_CAKE_HEAVY_FLOW_SRCHOST_TAG,
+	TCA_CAKE_HEAVY_FLOW_DSTHOST_TAG,
+	__TCA_CAKE_HEAVY_FLOW_MAX
+};
+#define TCA_CAKE_HEAVY_FLOW_MAX (__TCA_CAKE_HEAVY_FLOW_MAX - 1)
+
 enum {
 	__TCA_CAKE_TIN_STATS_INVALID,
 	TCA_CAKE_TIN_STATS_PAD,
@@ -932,10 +989,14 @@ enum {
 	TCA_CAKE_TIN_STATS_UNRESPONSIVE_FLOWS,
 	TCA_CAKE_TIN_STATS_MAX_SKBLEN,
 	TCA_CAKE_TIN_STATS_FLOW_QUANTUM,
+	TCA_CAKE_TIN_STATS_SCE_MARKED_PACKETS,
+	TCA_CAKE_TIN_STATS_HEAD_DROPPED_PACKETS,
+	TCA_CAKE_TIN_STATS_MEMORY_USED,
+	TCA_CAKE_TIN_STATS_HEAVY_FLOWS,
 	__TCA_CAKE_TIN_STATS_MAX
 };
 #define TCA_CAKE_TIN_STATS_MAX (__TCA_CAKE_TIN_STATS_MAX - 1)
-#define TC_CAKE_MAX_TINS (8)
+#define TC_CAKE_MAX_TINS (32)
 
 enum {
 	CAKE_FLOW_NONE = 0,
@@ -955,6 +1016,7 @@ enum {
 	CAKE_DIFFSERV_DIFFSERV8,
 	CAKE_DIFFSERV_BESTEFFORT,
 	CAKE_DIFFSERV_PRECEDENCE,
+	CAKE_DIFFSERV_CUSTOM,
 	CAKE_DIFFSERV_MAX
 };
 
@@ -965,6 +1027,20 @@ enum {
 	CAKE_ACK_MAX
 };
 
+enum {
+	CAKE_SPLIT_GSO_NONE = 0,
+	CAKE_SPLIT_GSO_ENQUEUE,	/* split every GSO packet as it arrives */
+	CAKE_SPLIT_GSO_DEQUEUE,	/* split at dequeue, only under contention */
+	CAKE_SPLIT_GSO_AUTO,	/* split at enqueue only at low shaped rates */
+	CAKE_SPLIT_GSO_MAX
+};
+
+enum {
+	CAKE_AUTORATE_EST_EWMA = 0,	/* smoothed peak rate of arrival bursts */
+	CAKE_AUTORATE_EST_MAXFILT,	/* windowed max of per-interval rates */
+	CAKE_AUTORATE_EST_MAX
+};
+
 enum {
 	CAKE_ATM_NONE = 0,
 	CAKE_ATM_ATM,
@@ -972,4 +1048,53 @@ enum {
 	CAKE_ATM_MAX
 };
 
+/* Per-tin parameters for CAKE_DIFFSERV_CUSTOM, one entry per tin in
+ * TCA_CAKE_TIN_PARAMS.  The tin threshold rate is rate_frac/65536 of the base
+ * rate (1 to 65536), and quantum is the bandwidth-sharing weight of the tin
+ * (1 to 65535).  The qdisc as a whole is always shaped at the base rate,
+ * whatever the fractions add up to.  A TCA_CAKE_DSCP_MAP needs tins, from
+ * this message or an earlier one.
+ */
+struct tc_cake_tin_params {
+	__u32	rate_frac;
+	__u32	quantum;
+};
+
+/* Per-tin AQM overrides, one entry per tin in priority order (as used by
+ * marks and priorities) in TCA_CAKE_TIN_AQM.  Zero keeps the default: the
+ * global target and rtt for the first two, and 1/256 and 1/4096 for the BLUE
+ * increment and decrement, which are 0.32 fixed point.
+ */
+struct tc_cake_tin_aqm {
+	__u32	target_us;
+	__u32	interval_us;
+	__u32	p_inc;
+	__u32	p_dec;
+};
+
+/* Connection a flow slot was last allocated to (TCA_CAKE_STATS_FLOW_KEY in the
+ * class stats, with TCA_CAKE_FLOW_KEYS enabled).  Addresses and ports are in
+ * network byte order; the flow hash may sort them, so source and destination
+ * can appear swapped.  IPv4 addresses use the first word only.
+ */
+struct tc_cake_flow_key {
+	__be32	src[4];
+	__be32	dst[4];
+	__be16	src_port;
+	__be16	dst_port;
+	__u8	ip_version;
+	__u8	proto;
+	__u16	pad;
+};
+
+/* Verdict of a CAKE classifier program (TCA_CAKE_BPF_FD).  Each field is
+ * 1-based, with zero meaning "no override, classify as usual".
+ */
+#define TC_CAKE_BPF_FLOW_MASK	0x000007FF
+#define TC_CAKE_BPF_HOST_SHIFT	11
+#define TC_CAKE_BPF_HOST_MASK	0x003FF800
+#define TC_CAKE_BPF_DROP	0x00800000
+#define TC_CAKE_BPF_TIN_SHIFT	24
+#define TC_CAKE_BPF_TIN_MASK	0xFF000000
+
 #endif
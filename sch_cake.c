@@ -67,6 +67,7 @@
 #include <linux/version.h>
 #include "pkt_sched.h"
 #include <net/pkt_cls.h>
+#include <linux/filter.h>
 #include <linux/if_vlan.h>
 #include <net/tcp.h>
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
@@ -83,8 +84,16 @@
 #endif
 
 #define CAKE_SET_WAYS (8)
-#define CAKE_MAX_TINS (8)
+#define CAKE_MAX_TINS (32)
+#define CAKE_DEFAULT_TINS (8) /* allocated up front, grown on demand */
 #define CAKE_QUEUES (1024)
+#define CAKE_HOSTS (2048) /* shared by all tins */
+#define CAKE_RATE_FRAC_ONE (1 << 16)
+#define CAKE_MAXFILT_SLOTS (8)
+#define CAKE_COMPACT_LEN (512) /* largest packet worth copying to save memory */
+#define CAKE_MEM_TOP_FLOWS (8)
+#define CAKE_MEM_TOP_DST (0x8000) /* host key is a destination host */
+#define CAKE_HEAVY_FLOWS (8)
 #define CAKE_FLOW_MASK 63
 #define CAKE_FLOW_NAT_FLAG 64
 
@@ -94,6 +103,7 @@
  * @mtu_time:   serialisation delay of maximum-size packet
  * @p_inc:      increment of blue drop probability (0.32 fxp)
  * @p_dec:      decrement of blue drop probability (0.32 fxp)
+ * @sce_thresh: sojourn at which SCE marking starts, 0 if disabled
  */
 struct cobalt_params {
 	u64	interval;
@@ -101,6 +111,7 @@ struct cobalt_params {
 	u64	mtu_time;
 	u32	p_inc;
 	u32	p_dec;
+	u32	sce_thresh;
 };
 
 /* struct cobalt_vars - contains codel and blue variables
@@ -111,6 +122,7 @@ struct cobalt_params {
  * @p_drop:		BLUE drop probability (0.32 fxp)
  * @dropping:		set if in dropping state
  * @ecn_marked:		set if marked
+ * @sce_marked:		set if marked ECT(1) for Some Congestion Experienced
  */
 struct cobalt_vars {
 	u32	count;
@@ -120,14 +132,14 @@ struct cobalt_vars {
 	u32     p_drop;
 	bool	dropping;
 	bool    ecn_marked;
+	bool	sce_marked;
 };
 
 enum {
 	CAKE_SET_NONE = 0,
 	CAKE_SET_SPARSE,
 	CAKE_SET_SPARSE_WAIT, /* counted in SPARSE, actually in BULK */
-	CAKE_SET_BULK,
-	CAKE_SET_DECAYING
+	CAKE_SET_BULK
 };
 
 struct cake_flow {
@@ -147,18 +159,45 @@ struct cake_host {
 	u32 dsthost_tag;
 	u16 srchost_bulk_flow_count;
 	u16 dsthost_bulk_flow_count;
+	ktime_t srchost_time_next; /* per-host rate cap */
+	ktime_t dsthost_time_next;
+	u32 srchost_mem; /* truesize of queued packets, per-host quota */
+	u32 dsthost_mem;
+	u16 srchost_victim; /* largest flow charged: tin * CAKE_QUEUES + flow */
+	u16 dsthost_victim;
+};
+
+/* Space-saving summary of the flows sending the most bytes in a tin */
+struct cake_heavy_entry {
+	u32 tag;
+	u32 bytes;
+	u16 flow;
+};
+
+/* Candidates for the largest memory users, kept as packets are charged and
+ * released so the stats dump need not scan every flow.  Each key's usage is
+ * stored beside it and kept current while it is a candidate.
+ */
+struct cake_mem_top {
+	u16 cnt;
+	u16 key[CAKE_MEM_TOP_FLOWS];
+	u32 mem[CAKE_MEM_TOP_FLOWS];
 };
 
 struct cake_heap_entry {
-	u16 t:3, b:10;
+	u16 t:5, b:10;
 };
 
 struct cake_tin_data {
 	struct cake_flow flows[CAKE_QUEUES];
 	u32	backlogs[CAKE_QUEUES];
+	u32	flow_mem[CAKE_QUEUES];	/* truesize queued per flow */
+	u32	tin_mem;
 	u32	tags[CAKE_QUEUES]; /* for set association */
 	u16	overflow_idx[CAKE_QUEUES];
-	struct cake_host hosts[CAKE_QUEUES]; /* for triple isolation */
+	struct cake_host *hosts; /* qdisc-wide, for triple isolation */
+	u32	host_perturb;
+	struct tc_cake_flow_key *flow_keys; /* per slot, if CAKE_FLAG_FLOW_KEYS */
 	u32	perturb;
 	u16	flow_quantum;
 
@@ -166,26 +205,27 @@ struct cake_tin_data {
 	u32	drop_overlimit;
 	u16	bulk_flow_count;
 	u16	sparse_flow_count;
-	u16	decaying_flow_count;
 	u16	unresponsive_flow_count;
 
 	u32	max_skblen;
 
 	struct list_head new_flows;
 	struct list_head old_flows;
-	struct list_head decaying_flows;
 
 	/* time_next = time_this + ((len * rate_ns) >> rate_shft) */
 	ktime_t	time_next_packet;
 	u64	tin_rate_ns;
 	u64	tin_rate_bps;
 	u16	tin_rate_shft;
+	u32	tin_rate_frac;	/* share of rate_bps, 16.16 fixed point */
 
 	u16	tin_quantum;
 	s32	tin_deficit;
 	u32	tin_backlog;
 	u32	tin_dropped;
 	u32	tin_ecn_mark;
+	u32	tin_sce_mark;
+	u32	head_drops;
 
 	u32	packets;
 	u64	bytes;
@@ -202,19 +242,31 @@ struct cake_tin_data {
 	u32	way_hits;
 	u32	way_misses;
 	u32	way_collisions;
+
+	/* heavy hitters, counts halved every interval */
+	struct cake_heavy_entry heavy[CAKE_HEAVY_FLOWS];
+	u16	heavy_cnt;
+	ktime_t	heavy_decay_time;
 }; /* number of tins is small, so size of this struct doesn't matter much */
 
 struct cake_sched_data {
 	struct tcf_proto __rcu *filter_list; /* optional external classifier */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
 	struct tcf_block *block;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	struct bpf_prog __rcu *classify_prog; /* direct BPF classifier */
 #endif
 	struct cake_tin_data *tins;
+	struct cake_host *hosts; /* CAKE_HOSTS, shared by all tins */
+	u32		host_perturb;
 
-	struct cake_heap_entry overflow_heap[CAKE_QUEUES * CAKE_MAX_TINS];
+	struct cake_heap_entry *overflow_heap; /* CAKE_QUEUES per allocated tin */
 	u16		overflow_timeout;
 
 	u16		tin_cnt;
+	u16		tin_alloc;
+	u32		active_tins; /* one bit per tin which may have flows */
 	u8		tin_mode;
 	u8		flow_mode;
 	u8		ack_filter;
@@ -232,12 +284,24 @@ struct cake_sched_data {
 	u16		rate_flags;
 	s16		rate_overhead;
 	u16		rate_mpu;
+	u32		*adjlen_table;	/* adjusted length by network length */
+	u32		adjlen_cnt;
 	u64		interval;
 	u64		target;
 
+	/* per-host cap: host_next = host_this + ((len * rate_ns) >> shft).
+	 * Host state is qdisc-wide, so the cap covers a host's traffic in all
+	 * tins together rather than applying once per tin.
+	 */
+	u64		host_rate_bps;
+	u64		host_rate_ns;
+	u16		host_rate_shft;
+
 	/* resource tracking */
 	u32		buffer_used;
 	u32		buffer_max_used;
+	struct cake_mem_top mem_top_flows; /* key: tin * CAKE_QUEUES + flow */
+	struct cake_mem_top mem_top_hosts; /* key: host | CAKE_MEM_TOP_DST */
 	u32		buffer_limit;
 	u32		buffer_config_limit;
 
@@ -249,6 +313,23 @@ struct cake_sched_data {
 	const u8	*tin_index;
 	const u8	*tin_order;
 
+	/* user-supplied codepoint map and tins for CAKE_DIFFSERV_CUSTOM */
+	u8		custom_index[64];
+	u16		custom_tin_cnt;
+	struct tc_cake_tin_params custom_tins[CAKE_MAX_TINS];
+
+	/* per-tin AQM overrides, in tin priority order */
+	u16		tin_aqm_cnt;
+	struct tc_cake_tin_aqm tin_aqm[CAKE_MAX_TINS];
+
+	/* L4S low-latency tin, CAKE_MAX_TINS when not in use */
+	u16		l4s_tin;
+	u64		l4s_step_ns;
+	u32		sce_thresh_us;
+	u32		head_drop_mult;	/* head drop past this many intervals */
+	u32		host_mem_pct;	/* per-host share of buffer_limit */
+	u32		compacted;
+
 	/* bandwidth capacity estimate */
 	ktime_t		last_packet_time;
 	ktime_t		avg_window_begin;
@@ -256,6 +337,18 @@ struct cake_sched_data {
 	u64		avg_window_bytes;
 	u64		avg_peak_bandwidth;
 	ktime_t		last_reconfig_time;
+	u32		autorate_estimator;
+	u8		maxfilt_idx;
+	u64		maxfilt_bw[CAKE_MAXFILT_SLOTS];
+
+	/* egress autorate controller */
+	u64		autorate_min_bps;
+	u64		autorate_max_bps;
+	u64		feedback_delay_ns;
+	ktime_t		feedback_time;
+	bool		feedback_used;	/* report already acted on */
+	ktime_t		egress_period_begin;
+	u64		egress_sojourn_min;
 
 	/* packet length stats */
 	u32		avg_netoff;
@@ -270,7 +363,13 @@ enum {
 	CAKE_FLAG_AUTORATE_INGRESS = BIT(1),
 	CAKE_FLAG_INGRESS	   = BIT(2),
 	CAKE_FLAG_WASH		   = BIT(3),
-	CAKE_FLAG_SPLIT_GSO	   = BIT(4)
+	CAKE_FLAG_SPLIT_GSO	   = BIT(4),
+	CAKE_FLAG_SPLIT_GSO_LAZY   = BIT(5),
+	CAKE_FLAG_SPLIT_GSO_AUTO   = BIT(6),
+	CAKE_FLAG_AUTORATE_EGRESS  = BIT(7),
+	CAKE_FLAG_L4S		   = BIT(8),
+	CAKE_FLAG_COMPACT	   = BIT(9),
+	CAKE_FLAG_FLOW_KEYS	   = BIT(10)
 };
 
 /* COBALT operates the Codel and BLUE algorithms in parallel, in order to
@@ -282,6 +381,14 @@ enum {
 struct cobalt_skb_cb {
 	ktime_t enqueue_time;
 	u32     adjusted_len;
+	u16     mem_host;	/* host charged with this packet's truesize */
+	u8      mem_side;	/* CAKE_MEM_SRCHOST, CAKE_MEM_DSTHOST or none */
+};
+
+enum {
+	CAKE_MEM_NONE,
+	CAKE_MEM_SRCHOST,
+	CAKE_MEM_DSTHOST
 };
 
 static u64 us_to_ns(u64 us)
@@ -367,8 +474,19 @@ static const u8 besteffort[] = {
 
 /* tin priority order for stats dumping */
 
-static const u8 normal_order[] = {0, 1, 2, 3, 4, 5, 6, 7};
-static const u8 bulk_order[] = {1, 0, 2, 3};
+static const u8 normal_order[CAKE_MAX_TINS] = {
+	0, 1, 2, 3, 4, 5, 6, 7,
+	8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23,
+	24, 25, 26, 27, 28, 29, 30, 31,
+};
+
+static const u8 bulk_order[CAKE_MAX_TINS] = {
+	1, 0, 2, 3, 4, 5, 6, 7,
+	8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23,
+	24, 25, 26, 27, 28, 29, 30, 31,
+};
 
 #define REC_INV_SQRT_CACHE (16)
 static u32 cobalt_rec_inv_sqrt_cache[REC_INV_SQRT_CACHE] = {0};
@@ -452,6 +570,62 @@ static ktime_t cobalt_control(ktime_t t,
 						rec_inv_sqrt));
 }
 
+/* Step count down once for every signalling interval that has passed since
+ * drop_next.  After a long quiet spell that can be many intervals, so past the
+ * first few steps the remainder is solved in closed form: the intervals from
+ * count m up to c sum to about 2 * interval * (sqrt(c) - sqrt(m)).
+ */
+#define COBALT_DECAY_STEPS (4)
+
+static void cobalt_decay_count(struct cobalt_vars *vars,
+			       struct cobalt_params *p,
+			       ktime_t now)
+{
+	u64 elapsed, periods;
+	u32 sqrt_c, delta = 0;
+	int i;
+
+	for (i = 0; i < COBALT_DECAY_STEPS; i++) {
+		if (!vars->count ||
+		    ktime_to_ns(ktime_sub(now, vars->drop_next)) < 0)
+			return;
+
+		vars->count--;
+		cobalt_invsqrt(vars);
+		vars->drop_next = cobalt_control(vars->drop_next,
+						 p->interval,
+						 vars->rec_inv_sqrt);
+	}
+
+	if (!vars->count || ktime_to_ns(ktime_sub(now, vars->drop_next)) < 0)
+		return;
+
+	/* sqrt(count) and elapsed / (2 * interval), both in Q8 */
+	elapsed = ktime_to_ns(ktime_sub(now, vars->drop_next));
+	periods = div64_u64(elapsed, max_t(u64, p->interval, 1));
+	sqrt_c = int_sqrt(min_t(u32, vars->count, U16_MAX) << 16);
+
+	if (periods >= sqrt_c) {
+		vars->count = 0;
+	} else {
+		delta = div64_u64(elapsed << 7, max_t(u64, p->interval, 1));
+		if (delta >= sqrt_c)
+			vars->count = 0;
+		else
+			vars->count = ((u64)(sqrt_c - delta) *
+				       (sqrt_c - delta)) >> 16;
+	}
+
+	if (vars->count < REC_INV_SQRT_CACHE) {
+		cobalt_invsqrt(vars);
+	} else {
+		/* seed with 1/sqrt(count) from the root above, then refine */
+		vars->rec_inv_sqrt = div64_u64(1ULL << 40, sqrt_c - delta);
+		cobalt_newton_step(vars);
+	}
+	vars->drop_next = cobalt_control(now, p->interval, vars->rec_inv_sqrt);
+}
+
 /* Call this when a packet had to be dropped due to queue overflow.  Returns
  * true if the BLUE state was quiescent before but active after this call.
  */
@@ -507,6 +681,33 @@ static bool cobalt_queue_empty(struct cobalt_vars *vars,
 	return down;
 }
 
+/* Call this when an idle queue receives a packet again.  Brings the state up
+ * to date as if cobalt_queue_empty() had been called at every opportunity
+ * while the queue was idle, so idle flows need no timer to decay.  Returns
+ * true if the BLUE state is still active.
+ */
+static bool cobalt_catch_up(struct cobalt_vars *vars,
+			    struct cobalt_params *p,
+			    ktime_t now)
+{
+	u64 idle = ktime_to_ns(ktime_sub(now, vars->blue_timer));
+
+	if (vars->p_drop && idle > p->target) {
+		u64 steps = div64_u64(idle, p->target);
+
+		if (steps >= vars->p_drop / p->p_dec)
+			vars->p_drop = 0;
+		else
+			vars->p_drop -= steps * p->p_dec;
+		vars->blue_timer = now;
+	}
+	vars->dropping = false;
+
+	cobalt_decay_count(vars, p, now);
+
+	return !!vars->p_drop;
+}
+
 /* Call this with a freshly dequeued packet for possible congestion marking.
  * Returns true as an instruction to drop the packet, false for delivery.
  */
@@ -543,6 +744,7 @@ static bool cobalt_should_drop(struct cobalt_vars *vars,
 	next_due = vars->count && ktime_to_ns(schedule) >= 0;
 
 	vars->ecn_marked = false;
+	vars->sce_marked = false;
 
 	if (over_target) {
 		if (!vars->dropping) {
@@ -569,22 +771,30 @@ static bool cobalt_should_drop(struct cobalt_vars *vars,
 						 p->interval,
 						 vars->rec_inv_sqrt);
 		schedule = ktime_sub(now, vars->drop_next);
-	} else {
-		while (next_due) {
-			vars->count--;
-			cobalt_invsqrt(vars);
-			vars->drop_next = cobalt_control(vars->drop_next,
-							 p->interval,
-							 vars->rec_inv_sqrt);
-			schedule = ktime_sub(now, vars->drop_next);
-			next_due = vars->count && ktime_to_ns(schedule) >= 0;
-		}
+	} else if (next_due) {
+		cobalt_decay_count(vars, p, now);
+		schedule = ktime_sub(now, vars->drop_next);
 	}
 
 	/* Simple BLUE implementation.  Lack of ECN is deliberate. */
 	if (vars->p_drop)
 		drop |= (prandom_u32() < vars->p_drop);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	/* Some Congestion Experienced: turn ECT(0) into ECT(1) with a
+	 * probability ramping from 0 at sce_thresh to 1 at twice that, giving
+	 * capable senders a proportional signal well before CoDel acts.
+	 */
+	if (p->sce_thresh && !drop && !vars->ecn_marked &&
+	    sojourn > p->sce_thresh) {
+		u64 excess = sojourn - p->sce_thresh;
+
+		if (excess >= p->sce_thresh ||
+		    reciprocal_scale(prandom_u32(), p->sce_thresh) < excess)
+			vars->sce_marked = INET_ECN_set_ect1(skb);
+	}
+#endif
+
 	/* Overload the drop_next field as an activity timeout */
 	if (!vars->count)
 		vars->drop_next = ktime_add_ns(now, p->interval);
@@ -689,11 +899,86 @@ static bool cake_ddst(int flow_mode)
 	return (flow_mode & CAKE_FLOW_DUAL_DST) == CAKE_FLOW_DUAL_DST;
 }
 
+/* Remember which connection a flow slot was allocated to, for class stats.
+ * Only called when a slot changes hands, so this stays off the fast path.
+ */
+static void cake_store_flow_key(struct tc_cake_flow_key *k,
+				const struct flow_keys *keys)
+{
+	memset(k, 0, sizeof(*k));
+
+#if KERNEL_VERSION(4, 2, 0) > LINUX_VERSION_CODE
+	k->ip_version = 4;
+	k->src[0] = keys->src;
+	k->dst[0] = keys->dst;
+	k->src_port = keys->port16[0];
+	k->dst_port = keys->port16[1];
+	k->proto = keys->ip_proto;
+#else
+	switch (keys->control.addr_type) {
+	case FLOW_DISSECTOR_KEY_IPV4_ADDRS:
+		k->ip_version = 4;
+		k->src[0] = keys->addrs.v4addrs.src;
+		k->dst[0] = keys->addrs.v4addrs.dst;
+		break;
+
+	case FLOW_DISSECTOR_KEY_IPV6_ADDRS:
+		k->ip_version = 6;
+		memcpy(k->src, &keys->addrs.v6addrs.src, sizeof(k->src));
+		memcpy(k->dst, &keys->addrs.v6addrs.dst, sizeof(k->dst));
+		break;
+
+	default:
+		return;
+	}
+	k->src_port = keys->ports.src;
+	k->dst_port = keys->ports.dst;
+	k->proto = keys->basic.ip_proto;
+#endif
+}
+
+/* Choose the way in a host set to give a new tag, starting from @k.  A way no
+ * flow is counted against, no memory is charged to and whose rate cap has
+ * expired is taken first, so a newcomer inherits neither another host's
+ * backlog nor its delay.  Failing that, the least busy way, or @k itself.
+ */
+static u32 cake_host_way(const struct cake_host *set, bool dst, u32 k,
+			 ktime_t now)
+{
+	u32 i, best = k, best_score = 0;
+
+	for (i = 0; i < CAKE_SET_WAYS; i++, k = (k + 1) % CAKE_SET_WAYS) {
+		const struct cake_host *h = &set[k];
+		u32 score = 0;
+
+		if (!(dst ? h->dsthost_bulk_flow_count :
+			    h->srchost_bulk_flow_count))
+			score += 4;
+		if (!(dst ? h->dsthost_mem : h->srchost_mem))
+			score += 2;
+		if (!ktime_after(dst ? h->dsthost_time_next :
+				       h->srchost_time_next, now))
+			score += 1;
+
+		if (score == 7)
+			return k;
+
+		if (score > best_score) {
+			best_score = score;
+			best = k;
+		}
+	}
+
+	return best;
+}
+
 static u32 cake_hash(struct cake_tin_data *q, const struct sk_buff *skb,
-		     int flow_mode, u16 flow_override, u16 host_override)
+		     int flow_mode, u16 flow_override, u16 host_override,
+		     ktime_t now)
 {
 	u32 flow_hash = 0, srchost_hash = 0, dsthost_hash = 0;
 	u16 reduced_hash, srchost_idx, dsthost_idx;
+	bool dissected = false;
 #if KERNEL_VERSION(4, 2, 0) > LINUX_VERSION_CODE
 	struct flow_keys keys;
 #else
@@ -708,14 +993,16 @@ static u32 cake_hash(struct cake_tin_data *q, const struct sk_buff *skb,
 	    (host_override || !(flow_mode & CAKE_FLOW_HOSTS)))
 		goto skip_hash;
 
+	dissected = true;
+
 #if KERNEL_VERSION(4, 2, 0) > LINUX_VERSION_CODE
 	skb_flow_dissect(skb, &keys);
 
 	if (flow_mode & CAKE_FLOW_NAT_FLAG)
 		cake_update_flowkeys(&keys, skb);
 
-	srchost_hash = jhash_1word((__force u32)keys.src, q->perturb);
-	dsthost_hash = jhash_1word((__force u32)keys.dst, q->perturb);
+	srchost_hash = jhash_1word((__force u32)keys.src, q->host_perturb);
+	dsthost_hash = jhash_1word((__force u32)keys.dst, q->host_perturb);
 
 	if (flow_mode & CAKE_FLOW_FLOWS)
 		flow_hash = jhash_3words((__force u32)keys.dst, (__force u32)keys.src ^ keys.ip_proto, (__force u32)keys.ports, q->perturb);
@@ -837,6 +1124,10 @@ skip_hash:
 				q->way_misses++;
 				allocate_src = cake_dsrc(flow_mode);
 				allocate_dst = cake_ddst(flow_mode);
+				/* idle queues keep their AQM state for
+				 * lazy decay; don't hand it to a new flow
+				 */
+				cobalt_vars_init(&q->flows[outer_hash + k].cvars);
 				goto found;
 			}
 		}
@@ -846,8 +1137,21 @@ skip_hash:
 		 */
 		q->way_collisions++;
 		if (q->flows[outer_hash + k].set == CAKE_SET_BULK) {
-			q->hosts[q->flows[reduced_hash].srchost].srchost_bulk_flow_count--;
-			q->hosts[q->flows[reduced_hash].dsthost].dsthost_bulk_flow_count--;
+			struct cake_host *srchost =
+				&q->hosts[q->flows[reduced_hash].srchost];
+			struct cake_host *dsthost =
+				&q->hosts[q->flows[reduced_hash].dsthost];
+
+			/* the host table is shared by all tins, so an
+			 * underflow here would skew every tin's host load
+			 */
+			if (cake_dsrc(flow_mode) &&
+			    srchost->srchost_bulk_flow_count)
+				srchost->srchost_bulk_flow_count--;
+
+			if (cake_ddst(flow_mode) &&
+			    dsthost->dsthost_bulk_flow_count)
+				dsthost->dsthost_bulk_flow_count--;
 		}
 		allocate_src = cake_dsrc(flow_mode);
 		allocate_dst = cake_ddst(flow_mode);
@@ -856,8 +1160,17 @@ found:
 		reduced_hash = outer_hash + k;
 		q->tags[reduced_hash] = flow_hash;
 
+		if (unlikely(q->flow_keys)) {
+			if (dissected)
+				cake_store_flow_key(&q->flow_keys[reduced_hash],
+						    &keys);
+			else
+				memset(&q->flow_keys[reduced_hash], 0,
+				       sizeof(struct tc_cake_flow_key));
+		}
+
 		if (allocate_src) {
-			srchost_idx = srchost_hash % CAKE_QUEUES;
+			srchost_idx = srchost_hash % CAKE_HOSTS;
 			inner_hash = srchost_idx % CAKE_SET_WAYS;
 			outer_hash = srchost_idx - inner_hash;
 			for (i = 0, k = inner_hash; i < CAKE_SET_WAYS;
@@ -866,11 +1179,7 @@ found:
 				    srchost_hash)
 					goto found_src;
 			}
-			for (i = 0; i < CAKE_SET_WAYS;
-				i++, k = (k + 1) % CAKE_SET_WAYS) {
-				if (!q->hosts[outer_hash + k].srchost_bulk_flow_count)
-					break;
-			}
+			k = cake_host_way(&q->hosts[outer_hash], false, k, now);
 			q->hosts[outer_hash + k].srchost_tag = srchost_hash;
 found_src:
 			srchost_idx = outer_hash + k;
@@ -880,7 +1189,7 @@ found_src:
 		}
 
 		if (allocate_dst) {
-			dsthost_idx = dsthost_hash % CAKE_QUEUES;
+			dsthost_idx = dsthost_hash % CAKE_HOSTS;
 			inner_hash = dsthost_idx % CAKE_SET_WAYS;
 			outer_hash = dsthost_idx - inner_hash;
 			for (i = 0, k = inner_hash; i < CAKE_SET_WAYS;
@@ -889,11 +1198,7 @@ found_src:
 				    dsthost_hash)
 					goto found_dst;
 			}
-			for (i = 0; i < CAKE_SET_WAYS;
-			     i++, k = (k + 1) % CAKE_SET_WAYS) {
-				if (!q->hosts[outer_hash + k].dsthost_bulk_flow_count)
-					break;
-			}
+			k = cake_host_way(&q->hosts[outer_hash], true, k, now);
 			q->hosts[outer_hash + k].dsthost_tag = dsthost_hash;
 found_dst:
 			dsthost_idx = outer_hash + k;
@@ -1366,16 +1671,8 @@ static u64 cake_ewma(u64 avg, u64 sample, u32 shift)
 	return avg;
 }
 
-static u32 cake_calc_overhead(struct cake_sched_data *q, u32 len, u32 off)
+static u32 cake_adjust_len(const struct cake_sched_data *q, u32 len)
 {
-	if (q->rate_flags & CAKE_FLAG_OVERHEAD)
-		len -= off;
-
-	if (q->max_netlen < len)
-		q->max_netlen = len;
-	if (q->min_netlen > len)
-		q->min_netlen = len;
-
 	len += q->rate_overhead;
 
 	if (len < q->rate_mpu)
@@ -1393,6 +1690,24 @@ static u32 cake_calc_overhead(struct cake_sched_data *q, u32 len, u32 off)
 		len += (len + 63) / 64;
 	}
 
+	return len;
+}
+
+static u32 cake_calc_overhead(struct cake_sched_data *q, u32 len, u32 off)
+{
+	if (q->rate_flags & CAKE_FLAG_OVERHEAD)
+		len -= off;
+
+	if (q->max_netlen < len)
+		q->max_netlen = len;
+	if (q->min_netlen > len)
+		q->min_netlen = len;
+
+	if (likely(len < q->adjlen_cnt))
+		len = q->adjlen_table[len];
+	else
+		len = cake_adjust_len(q, len);
+
 	if (q->max_adjlen < len)
 		q->max_adjlen = len;
 	if (q->min_adjlen > len)
@@ -1469,7 +1784,7 @@ static u32 cake_heap_get_backlog(const struct cake_sched_data *q, u16 i)
 
 static void cake_heapify(struct cake_sched_data *q, u16 i)
 {
-	static const u32 a = CAKE_MAX_TINS * CAKE_QUEUES;
+	u32 a = q->tin_alloc * CAKE_QUEUES;
 	u32 mb = cake_heap_get_backlog(q, i);
 	u32 m = i;
 
@@ -1506,7 +1821,7 @@ static void cake_heapify(struct cake_sched_data *q, u16 i)
 
 static void cake_heapify_up(struct cake_sched_data *q, u16 i)
 {
-	while (i > 0 && i < CAKE_MAX_TINS * CAKE_QUEUES) {
+	while (i > 0 && i < q->tin_alloc * CAKE_QUEUES) {
 		u16 p = (i - 1) >> 1;
 		u32 ib = cake_heap_get_backlog(q, i);
 		u32 pb = cake_heap_get_backlog(q, p);
@@ -1553,14 +1868,158 @@ static int cake_advance_shaper(struct cake_sched_data *q,
 	return len;
 }
 
+/* The host whose rate cap applies to a flow: the destination on ingress, the
+ * source on egress, or whichever side the flow mode isolates.  All tins share
+ * the host table, so this is one timer per host across the whole qdisc.
+ */
+static ktime_t *cake_host_time_next(struct cake_sched_data *q,
+				    struct cake_tin_data *b,
+				    struct cake_flow *flow)
+{
+	if (cake_ddst(q->flow_mode) &&
+	    (!cake_dsrc(q->flow_mode) || q->rate_flags & CAKE_FLAG_INGRESS))
+		return &b->hosts[flow->dsthost].dsthost_time_next;
+
+	if (cake_dsrc(q->flow_mode))
+		return &b->hosts[flow->srchost].srchost_time_next;
+
+	return NULL;
+}
+
+/* Memory is charged to the same host the rate cap applies to. */
+static u8 cake_mem_side(const struct cake_sched_data *q)
+{
+	if (cake_ddst(q->flow_mode) &&
+	    (!cake_dsrc(q->flow_mode) || q->rate_flags & CAKE_FLAG_INGRESS))
+		return CAKE_MEM_DSTHOST;
+
+	if (cake_dsrc(q->flow_mode))
+		return CAKE_MEM_SRCHOST;
+
+	return CAKE_MEM_NONE;
+}
+
+static u32 cake_flow_mem_of(const struct cake_sched_data *q, u16 key)
+{
+	return q->tins[key / CAKE_QUEUES].flow_mem[key % CAKE_QUEUES];
+}
+
+/* Record that @key now uses @mem.  A candidate's usage is updated in place;
+ * any other key takes the place of the smallest candidate if it has grown past
+ * it, so one that has drained gives way to the next charge.
+ */
+static void cake_mem_top_update(struct cake_mem_top *t, u16 key, u32 mem)
+{
+	int i, min = 0;
+
+	for (i = 0; i < t->cnt; i++) {
+		if (t->key[i] == key) {
+			t->mem[i] = mem;
+			return;
+		}
+
+		if (t->mem[i] < t->mem[min])
+			min = i;
+	}
+
+	if (t->cnt < CAKE_MEM_TOP_FLOWS)
+		min = t->cnt++;
+	else if (mem <= t->mem[min])
+		return;
+
+	t->key[min] = key;
+	t->mem[min] = mem;
+}
+
+/* Charge a packet's truesize to the tin, flow and host holding it.  The host
+ * is recorded in the packet, since a collision in cake_hash can move the flow
+ * to another host while it still has packets queued.
+ */
+static void cake_mem_charge(struct cake_sched_data *q,
+			    struct cake_tin_data *b,
+			    struct cake_flow *flow, struct sk_buff *skb)
+{
+	struct cobalt_skb_cb *cb = get_cobalt_cb(skb);
+	u32 idx = flow - b->flows;
+	u16 key = (b - q->tins) * CAKE_QUEUES + idx;
+	struct cake_host *h;
+
+	b->tin_mem += skb->truesize;
+	b->flow_mem[idx] += skb->truesize;
+	cake_mem_top_update(&q->mem_top_flows, key, b->flow_mem[idx]);
+
+	cb->mem_side = cake_mem_side(q);
+	cb->mem_host = cb->mem_side == CAKE_MEM_DSTHOST ? flow->dsthost :
+							  flow->srchost;
+	h = &b->hosts[cb->mem_host];
+
+	if (cb->mem_side == CAKE_MEM_DSTHOST) {
+		h->dsthost_mem += skb->truesize;
+		cake_mem_top_update(&q->mem_top_hosts,
+				    cb->mem_host | CAKE_MEM_TOP_DST,
+				    h->dsthost_mem);
+		if (b->flow_mem[idx] >= cake_flow_mem_of(q, h->dsthost_victim))
+			h->dsthost_victim = key;
+	} else if (cb->mem_side == CAKE_MEM_SRCHOST) {
+		h->srchost_mem += skb->truesize;
+		cake_mem_top_update(&q->mem_top_hosts, cb->mem_host,
+				    h->srchost_mem);
+		if (b->flow_mem[idx] >= cake_flow_mem_of(q, h->srchost_victim))
+			h->srchost_victim = key;
+	}
+}
+
+static void cake_mem_uncharge(struct cake_sched_data *q,
+			      struct cake_tin_data *b,
+			      struct cake_flow *flow, struct sk_buff *skb)
+{
+	struct cobalt_skb_cb *cb = get_cobalt_cb(skb);
+	struct cake_host *h = &b->hosts[cb->mem_host];
+	u32 idx = flow - b->flows;
+
+	b->tin_mem -= skb->truesize;
+	b->flow_mem[idx] -= skb->truesize;
+	cake_mem_top_update(&q->mem_top_flows,
+			    (b - q->tins) * CAKE_QUEUES + idx, b->flow_mem[idx]);
+
+	if (cb->mem_side == CAKE_MEM_DSTHOST) {
+		h->dsthost_mem -= skb->truesize;
+		cake_mem_top_update(&q->mem_top_hosts,
+				    cb->mem_host | CAKE_MEM_TOP_DST,
+				    h->dsthost_mem);
+	} else if (cb->mem_side == CAKE_MEM_SRCHOST) {
+		h->srchost_mem -= skb->truesize;
+		cake_mem_top_update(&q->mem_top_hosts, cb->mem_host,
+				    h->srchost_mem);
+	}
+	cb->mem_side = CAKE_MEM_NONE;
+}
+
+static void cake_advance_host(struct cake_sched_data *q,
+			      struct cake_tin_data *b,
+			      ktime_t *host_next, u32 len, ktime_t now)
+{
+	u64 host_dur = (len * q->host_rate_ns) >> q->host_rate_shft;
+	ktime_t floor = ktime_sub_ns(now, b->cparams.target);
+
+	/* an idle host may bank at most one target's worth of credit */
+	if (ktime_before(*host_next, floor))
+		*host_next = floor;
+
+	*host_next = ktime_add_ns(*host_next, host_dur);
+}
+
+/* Drop the head of the longest queue.  The caller passes in its own
+ * timestamp, so the overflow loop in cake_enqueue reads the clock only once.
+ */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-static unsigned int cake_drop(struct Qdisc *sch)
+static unsigned int cake_drop(struct Qdisc *sch, ktime_t now)
 #else
-static unsigned int cake_drop(struct Qdisc *sch, struct sk_buff **to_free)
+static unsigned int cake_drop(struct Qdisc *sch, ktime_t now,
+			      struct sk_buff **to_free)
 #endif
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
-	ktime_t now = ktime_get();
 	u32 idx = 0, tin = 0, len;
 	struct cake_heap_entry qq;
 	struct cake_tin_data *b;
@@ -1570,7 +2029,7 @@ static unsigned int cake_drop(struct Qdisc *sch, struct sk_buff **to_free)
 	if (!q->overflow_timeout) {
 		int i;
 		/* Build fresh max-heap */
-		for (i = CAKE_MAX_TINS * CAKE_QUEUES / 2; i >= 0; i--)
+		for (i = q->tin_alloc * CAKE_QUEUES / 2; i >= 0; i--)
 			cake_heapify(q, i);
 	}
 	q->overflow_timeout = 65535;
@@ -1598,6 +2057,7 @@ static unsigned int cake_drop(struct Qdisc *sch, struct sk_buff **to_free)
 	b->tin_backlog      -= len;
 	sch->qstats.backlog -= len;
 	qdisc_tree_reduce_backlog(sch, 1, len);
+	cake_mem_uncharge(q, b, flow, skb);
 
 	b->tin_dropped++;
 	sch->qstats.drops++;
@@ -1617,10 +2077,77 @@ static unsigned int cake_drop(struct Qdisc *sch, struct sk_buff **to_free)
 	return idx + (tin << 16);
 }
 
+/* Drop the packet at the head of one flow, as the overload paths in
+ * cake_enqueue do to a flow that has earned it.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+static void cake_drop_flow_head(struct Qdisc *sch, struct cake_tin_data *b,
+				u32 idx, ktime_t now)
+#else
+static void cake_drop_flow_head(struct Qdisc *sch, struct cake_tin_data *b,
+				u32 idx, ktime_t now, struct sk_buff **to_free)
+#endif
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	struct cake_flow *flow = &b->flows[idx];
+	struct sk_buff *skb = dequeue_head(flow);
+	u32 len = qdisc_pkt_len(skb);
+
+	if (cobalt_queue_full(&flow->cvars, &b->cparams, now))
+		b->unresponsive_flow_count++;
+
+	q->buffer_used      -= skb->truesize;
+	b->backlogs[idx]    -= len;
+	b->tin_backlog      -= len;
+	sch->qstats.backlog -= len;
+	qdisc_tree_reduce_backlog(sch, 1, len);
+	cake_mem_uncharge(q, b, flow, skb);
+
+	b->tin_dropped++;
+	sch->qstats.drops++;
+
+	if (q->rate_flags & CAKE_FLAG_INGRESS)
+		cake_advance_shaper(q, b, skb, now, true);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	kfree_skb(skb);
+#else
+	__qdisc_drop(skb, to_free);
+#endif
+	sch->q.qlen--;
+
+	if (q->overflow_timeout)
+		cake_heapify(q, b->overflow_idx[idx]);
+}
+
+/* Whether the packet at the head of @flow is charged to @host on @side, and so
+ * can be dropped to relieve that host's quota.  A collision in cake_hash may
+ * have moved the flow to another host since its older packets were queued.
+ */
+static bool cake_head_charged_to(const struct cake_flow *flow, u8 side,
+				 u16 host)
+{
+	const struct cobalt_skb_cb *cb;
+
+	if (!flow->head)
+		return false;
+
+	cb = get_cobalt_cb(flow->head);
+	return cb->mem_side == side && cb->mem_host == host;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+static unsigned int cake_drop_op(struct Qdisc *sch)
+{
+	return cake_drop(sch, ktime_get());
+}
+#endif
+
+/* Returns the whole DS field, ECN bits included, as found on arrival. */
 static u8 cake_handle_diffserv(struct sk_buff *skb, u16 wash)
 {
 	int wlen = skb_network_offset(skb);
-	u8 dscp;
+	u8 dsfield;
 
 	switch (tc_skb_protocol(skb)) {
 	case htons(ETH_P_IP):
@@ -1629,10 +2156,10 @@ static u8 cake_handle_diffserv(struct sk_buff *skb, u16 wash)
 		    skb_try_make_writable(skb, wlen))
 			return 0;
 
-		dscp = ipv4_get_dsfield(ip_hdr(skb)) >> 2;
-		if (wash && dscp)
+		dsfield = ipv4_get_dsfield(ip_hdr(skb));
+		if (wash && dsfield >> 2)
 			ipv4_change_dsfield(ip_hdr(skb), INET_ECN_MASK, 0);
-		return dscp;
+		return dsfield;
 
 	case htons(ETH_P_IPV6):
 		wlen += sizeof(struct ipv6hdr);
@@ -1640,13 +2167,13 @@ static u8 cake_handle_diffserv(struct sk_buff *skb, u16 wash)
 		    skb_try_make_writable(skb, wlen))
 			return 0;
 
-		dscp = ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
-		if (wash && dscp)
+		dsfield = ipv6_get_dsfield(ipv6_hdr(skb));
+		if (wash && dsfield >> 2)
 			ipv6_change_dsfield(ipv6_hdr(skb), INET_ECN_MASK, 0);
-		return dscp;
+		return dsfield;
 
 	case htons(ETH_P_ARP):
-		return 0x38;  /* CS7 - Net Control */
+		return 0x38 << 2;  /* CS7 - Net Control */
 
 	default:
 		/* If there is no Diffserv field, treat as best-effort */
@@ -1654,23 +2181,50 @@ static u8 cake_handle_diffserv(struct sk_buff *skb, u16 wash)
 	}
 }
 
+/* ECN codepoint of a packet whose network header cake_handle_diffserv()
+ * has already pulled in.
+ */
+static u8 cake_get_ecn(const struct sk_buff *skb)
+{
+	switch (tc_skb_protocol(skb)) {
+	case htons(ETH_P_IP):
+		return ipv4_get_dsfield(ip_hdr(skb)) & INET_ECN_MASK;
+
+	case htons(ETH_P_IPV6):
+		return ipv6_get_dsfield(ipv6_hdr(skb)) & INET_ECN_MASK;
+
+	default:
+		return INET_ECN_NOT_ECT;
+	}
+}
+
 static struct cake_tin_data *cake_select_tin(struct Qdisc *sch,
-					     struct sk_buff *skb)
+					     struct sk_buff *skb,
+					     u16 tin_override)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
 	u32 tin, mark;
-	u8 dscp;
+	u8 dsfield;
 
 	/* Tin selection: Default to diffserv-based selection, allow overriding
-	 * using firewall marks or skb->priority.
+	 * using a classifier program, firewall marks or skb->priority.  In L4S
+	 * mode, ECT(1) and CE identify scalable senders ahead of all of these.
 	 */
-	dscp = cake_handle_diffserv(skb,
-				    q->rate_flags & CAKE_FLAG_WASH);
+	dsfield = cake_handle_diffserv(skb,
+				       q->rate_flags & CAKE_FLAG_WASH);
 	mark = (skb->mark & q->fwmark_mask) >> q->fwmark_shft;
 
-	if (q->tin_mode == CAKE_DIFFSERV_BESTEFFORT)
+	if (q->l4s_tin < q->tin_cnt &&
+	    ((dsfield & INET_ECN_MASK) == INET_ECN_ECT_1 ||
+	     (dsfield & INET_ECN_MASK) == INET_ECN_CE))
+		tin = q->l4s_tin;
+
+	else if (q->tin_mode == CAKE_DIFFSERV_BESTEFFORT)
 		tin = 0;
 
+	else if (tin_override && tin_override <= q->tin_cnt)
+		tin = q->tin_order[tin_override - 1];
+
 	else if (mark && mark <= q->tin_cnt)
 		tin = q->tin_order[mark - 1];
 
@@ -1680,7 +2234,7 @@ static struct cake_tin_data *cake_select_tin(struct Qdisc *sch,
 		tin = q->tin_order[TC_H_MIN(skb->priority) - 1];
 
 	else {
-		tin = q->tin_index[dscp];
+		tin = q->tin_index[dsfield >> 2];
 
 		if (unlikely(tin >= q->tin_cnt))
 			tin = 0;
@@ -1690,14 +2244,46 @@ static struct cake_tin_data *cake_select_tin(struct Qdisc *sch,
 }
 
 static u32 cake_classify(struct Qdisc *sch, struct cake_tin_data **t,
-			 struct sk_buff *skb, int flow_mode, int *qerr)
+			 struct sk_buff *skb, int flow_mode, int *qerr,
+			 ktime_t now)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
+	u16 flow = 0, host = 0, tin = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	struct bpf_prog *prog;
+#endif
 	struct tcf_proto *filter;
 	struct tcf_result res;
-	u16 flow = 0, host = 0;
 	int result;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	/* A classifier program supplies tin, flow and host in one verdict,
+	 * and replaces the tc filter chain entirely.
+	 */
+	prog = rcu_dereference_bh(q->classify_prog);
+	if (prog) {
+		u32 verdict;
+
+		bpf_compute_data_pointers(skb);
+		verdict = bpf_prog_run(prog, skb);
+
+		if (verdict & TC_CAKE_BPF_DROP) {
+			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+			return 0;
+		}
+
+		flow = verdict & TC_CAKE_BPF_FLOW_MASK;
+		if (flow > CAKE_QUEUES)
+			flow = 0;
+		host = (verdict & TC_CAKE_BPF_HOST_MASK) >>
+			TC_CAKE_BPF_HOST_SHIFT;
+		if (host > CAKE_QUEUES)
+			host = 0;
+		tin = (verdict & TC_CAKE_BPF_TIN_MASK) >> TC_CAKE_BPF_TIN_SHIFT;
+		goto hash;
+	}
+#endif
+
 	filter = rcu_dereference_bh(q->filter_list);
 	if (!filter)
 		goto hash;
@@ -1725,30 +2311,183 @@ static u32 cake_classify(struct Qdisc *sch, struct cake_tin_data **t,
 			host = TC_H_MAJ(res.classid) >> 16;
 	}
 hash:
-	*t = cake_select_tin(sch, skb);
-	return cake_hash(*t, skb, flow_mode, flow, host) + 1;
+	*t = cake_select_tin(sch, skb, tin);
+	return cake_hash(*t, skb, flow_mode, flow, host, now) + 1;
 }
 
-static void cake_reconfigure(struct Qdisc *sch);
+static void cake_configure_rates(struct Qdisc *sch);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch)
-#else
-static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
-			struct sk_buff **to_free)
-#endif
+/* Put a flow that has just received a packet into the flowchain of its tin. */
+static void cake_activate_flow(struct cake_sched_data *q,
+			       struct cake_tin_data *b,
+			       struct cake_flow *flow, ktime_t now)
 {
-	struct cake_sched_data *q = qdisc_priv(sch);
-	int len = qdisc_pkt_len(skb);
-	int uninitialized_var(ret);
-	struct sk_buff *ack = NULL;
+	if (!flow->set) {
+		struct cake_host *srchost = &b->hosts[flow->srchost];
+		struct cake_host *dsthost = &b->hosts[flow->dsthost];
+		u16 host_load = 1;
+
+		if (cobalt_catch_up(&flow->cvars, &b->cparams, now))
+			b->unresponsive_flow_count++;
+
+		list_add_tail(&flow->flowchain, &b->new_flows);
+		flow->set = CAKE_SET_SPARSE;
+		b->sparse_flow_count++;
+
+		if (cake_dsrc(q->flow_mode))
+			host_load = max(host_load, srchost->srchost_bulk_flow_count);
+
+		if (cake_ddst(q->flow_mode))
+			host_load = max(host_load, dsthost->dsthost_bulk_flow_count);
+
+		/* bulk flows are counted across all tins */
+		WARN_ON_ONCE(host_load > CAKE_MAX_TINS * CAKE_QUEUES);
+		host_load = min_t(u16, host_load, CAKE_QUEUES);
+		flow->deficit = (b->flow_quantum *
+				 quantum_div[host_load]) >> 16;
+	} else if (flow->set == CAKE_SET_SPARSE_WAIT) {
+		struct cake_host *srchost = &b->hosts[flow->srchost];
+		struct cake_host *dsthost = &b->hosts[flow->dsthost];
+
+		/* this flow was empty, accounted as a sparse flow, but actually
+		 * in the bulk rotation.
+		 */
+		flow->set = CAKE_SET_BULK;
+		b->sparse_flow_count--;
+		b->bulk_flow_count++;
+
+		if (cake_dsrc(q->flow_mode))
+			srchost->srchost_bulk_flow_count++;
+
+		if (cake_ddst(q->flow_mode))
+			dsthost->dsthost_bulk_flow_count++;
+
+	}
+
+	q->active_tins |= BIT(b - q->tins);
+}
+
+/* Small packets received into large pages can carry many times their length
+ * in truesize, and buffer_limit is charged in truesize.  Copy those into a
+ * right-sized buffer, so the memory limit buys queue depth instead of slack.
+ * Socket-owned packets keep their buffer, as truesize is charged to the
+ * socket.  If the copy fails, the original is queued unchanged.
+ */
+static struct sk_buff *cake_compact(struct cake_sched_data *q,
+				    struct sk_buff *skb)
+{
+	struct sk_buff *nskb;
+
+	if (skb->len > CAKE_COMPACT_LEN || skb->sk ||
+	    skb->truesize <= 2 * SKB_TRUESIZE(skb->len))
+		return skb;
+
+	nskb = skb_copy_expand(skb, skb_headroom(skb), 0, GFP_ATOMIC);
+	if (!nskb)
+		return skb;
+
+	q->compacted++;
+	consume_skb(skb);
+	return nskb;
+}
+
+/* Default estimator: track the arrival rate of packet bursts, using an
+ * asymmetric EWMA over inter-arrival times to find where each burst ends.
+ * Returns true when avg_peak_bandwidth has been refreshed.
+ */
+static bool cake_estimate_ewma(struct cake_sched_data *q, ktime_t now)
+{
+	u64 packet_interval = ktime_to_ns(ktime_sub(now, q->last_packet_time));
+	u64 window_interval;
+	u64 b;
+
+	if (packet_interval > NSEC_PER_SEC)
+		packet_interval = NSEC_PER_SEC;
+
+	/* filter out short-term bursts, eg. wifi aggregation */
+	q->avg_packet_interval = \
+		cake_ewma(q->avg_packet_interval,
+			  packet_interval,
+			  (packet_interval > q->avg_packet_interval ?
+				  2 : 8));
+
+	q->last_packet_time = now;
+
+	if (packet_interval <= q->avg_packet_interval)
+		return false;
+
+	window_interval = ktime_to_ns(ktime_sub(now, q->avg_window_begin));
+	b = q->avg_window_bytes * (u64)NSEC_PER_SEC;
+
+	do_div(b, window_interval);
+	q->avg_peak_bandwidth =
+		cake_ewma(q->avg_peak_bandwidth, b,
+			  b > q->avg_peak_bandwidth ? 2 : 8);
+	q->avg_window_bytes = 0;
+	q->avg_window_begin = now;
+
+	return true;
+}
+
+/* Windowed max filter, after BBR's bottleneck bandwidth estimate.  Each sample
+ * is the arrival rate over at least one interval, which is long enough to
+ * average out link-layer aggregation, and the estimate is the largest of the
+ * last CAKE_MAXFILT_SLOTS samples, so it follows a capacity drop within a
+ * bounded time instead of decaying geometrically.  Windows that contain an
+ * idle gap longer than an interval are application-limited and discarded.
+ */
+static bool cake_estimate_maxfilt(struct cake_sched_data *q, ktime_t now)
+{
+	u64 packet_interval = ktime_to_ns(ktime_sub(now, q->last_packet_time));
+	u64 interval_ns = us_to_ns(q->interval);
+	u64 window_interval, b, max_bw = 0;
+	int i;
+
+	q->last_packet_time = now;
+
+	if (packet_interval > interval_ns) {
+		q->avg_window_bytes = 0;
+		q->avg_window_begin = now;
+		return false;
+	}
+
+	window_interval = ktime_to_ns(ktime_sub(now, q->avg_window_begin));
+	if (window_interval < interval_ns)
+		return false;
+
+	b = q->avg_window_bytes * (u64)NSEC_PER_SEC;
+	do_div(b, window_interval);
+	q->avg_window_bytes = 0;
+	q->avg_window_begin = now;
+
+	q->maxfilt_idx = (q->maxfilt_idx + 1) % CAKE_MAXFILT_SLOTS;
+	q->maxfilt_bw[q->maxfilt_idx] = b;
+
+	for (i = 0; i < CAKE_MAXFILT_SLOTS; i++)
+		max_bw = max(max_bw, q->maxfilt_bw[i]);
+
+	q->avg_peak_bandwidth = max_bw;
+	return true;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+#else
+static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+			struct sk_buff **to_free)
+#endif
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	int len = qdisc_pkt_len(skb);
+	int uninitialized_var(ret);
+	struct sk_buff *ack = NULL;
 	ktime_t now = ktime_get();
 	struct cake_tin_data *b;
 	struct cake_flow *flow;
 	u32 idx;
 
 	/* choose flow to insert into */
-	idx = cake_classify(sch, &b, skb, q->flow_mode, &ret);
+	idx = cake_classify(sch, &b, skb, q->flow_mode, &ret, now);
 	if (idx == 0) {
 		if (ret & __NET_XMIT_BYPASS)
 			qdisc_qstats_drop(sch);
@@ -1762,6 +2501,24 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 	idx--;
 	flow = &b->flows[idx];
 
+	/* Head drop from a flow whose oldest packet has waited far longer than
+	 * COBALT would ever allow, before it ties up more memory.
+	 */
+	if (q->head_drop_mult && flow->head) {
+		u64 limit = b->cparams.interval * q->head_drop_mult;
+
+		while (flow->head &&
+		       ktime_to_ns(ktime_sub(now, cobalt_get_enqueue_time(
+						   flow->head))) > limit) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+			cake_drop_flow_head(sch, b, idx, now);
+#else
+			cake_drop_flow_head(sch, b, idx, now, to_free);
+#endif
+			b->head_drops++;
+		}
+	}
+
 	/* ensure shaper state isn't stale */
 	if (!b->tin_backlog) {
 		if (ktime_before(b->time_next_packet, now))
@@ -1790,6 +2547,7 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		struct sk_buff *segs, *nskb;
 		netdev_features_t features = netif_skb_features(skb);
 		unsigned int slen = 0, numsegs = 0;
+		u32 truesize = 0;
 
 		segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
 		if (IS_ERR_OR_NULL(segs))
@@ -1807,15 +2565,18 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 			get_cobalt_cb(segs)->adjusted_len = cake_overhead(q,
 									  segs);
 			flow_queue_add(flow, segs);
+			cake_mem_charge(q, b, flow, segs);
 
 			sch->q.qlen++;
 			numsegs++;
 			slen += segs->len;
-			q->buffer_used += segs->truesize;
+			truesize += segs->truesize;
 			b->packets++;
 			segs = nskb;
 		}
 
+		q->buffer_used += truesize;
+
 		/* stats */
 		b->bytes	    += slen;
 		b->backlogs[idx]    += slen;
@@ -1827,6 +2588,9 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		consume_skb(skb);
 	} else {
 		/* not splitting */
+		if (q->rate_flags & CAKE_FLAG_COMPACT)
+			skb = cake_compact(q, skb);
+
 		cobalt_set_enqueue_time(skb, now);
 		get_cobalt_cb(skb)->adjusted_len = cake_overhead(q, skb);
 		flow_queue_add(flow, skb);
@@ -1840,6 +2604,8 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 			b->bytes += qdisc_pkt_len(ack);
 			len -= qdisc_pkt_len(ack);
 			q->buffer_used += skb->truesize - ack->truesize;
+			cake_mem_charge(q, b, flow, skb);
+			cake_mem_uncharge(q, b, flow, ack);
 			if (q->rate_flags & CAKE_FLAG_INGRESS)
 				cake_advance_shaper(q, b, ack, now, true);
 
@@ -1848,6 +2614,7 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		} else {
 			sch->q.qlen++;
 			q->buffer_used      += skb->truesize;
+			cake_mem_charge(q, b, flow, skb);
 		}
 
 		/* stats */
@@ -1864,40 +2631,18 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 
 	/* incoming bandwidth capacity estimate */
 	if (q->rate_flags & CAKE_FLAG_AUTORATE_INGRESS) {
-		u64 packet_interval = \
-			ktime_to_ns(ktime_sub(now, q->last_packet_time));
-
-		if (packet_interval > NSEC_PER_SEC)
-			packet_interval = NSEC_PER_SEC;
-
-		/* filter out short-term bursts, eg. wifi aggregation */
-		q->avg_packet_interval = \
-			cake_ewma(q->avg_packet_interval,
-				  packet_interval,
-				  (packet_interval > q->avg_packet_interval ?
-					  2 : 8));
-
-		q->last_packet_time = now;
-
-		if (packet_interval > q->avg_packet_interval) {
-			u64 window_interval = \
-				ktime_to_ns(ktime_sub(now,
-						      q->avg_window_begin));
-			u64 b = q->avg_window_bytes * (u64)NSEC_PER_SEC;
+		bool updated;
 
-			do_div(b, window_interval);
-			q->avg_peak_bandwidth =
-				cake_ewma(q->avg_peak_bandwidth, b,
-					  b > q->avg_peak_bandwidth ? 2 : 8);
-			q->avg_window_bytes = 0;
-			q->avg_window_begin = now;
+		if (q->autorate_estimator == CAKE_AUTORATE_EST_MAXFILT)
+			updated = cake_estimate_maxfilt(q, now);
+		else
+			updated = cake_estimate_ewma(q, now);
 
-			if (ktime_after(now,
-					ktime_add_ms(q->last_reconfig_time,
-						     250))) {
-				q->rate_bps = (q->avg_peak_bandwidth * 15) >> 4;
-				cake_reconfigure(sch);
-			}
+		if (updated &&
+		    ktime_after(now, ktime_add_ms(q->last_reconfig_time, 250))) {
+			q->rate_bps = (q->avg_peak_bandwidth * 15) >> 4;
+			q->last_reconfig_time = now;
+			cake_configure_rates(sch);
 		}
 	} else {
 		q->avg_window_bytes = 0;
@@ -1905,45 +2650,40 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 	}
 
 	/* flowchain */
-	if (!flow->set || flow->set == CAKE_SET_DECAYING) {
-		struct cake_host *srchost = &b->hosts[flow->srchost];
-		struct cake_host *dsthost = &b->hosts[flow->dsthost];
-		u16 host_load = 1;
+	cake_activate_flow(q, b, flow, now);
 
-		if (!flow->set) {
-			list_add_tail(&flow->flowchain, &b->new_flows);
-		} else {
-			b->decaying_flow_count--;
-			list_move_tail(&flow->flowchain, &b->new_flows);
+	/* per-host quota: an offending host loses its own packets first, from
+	 * the largest flow charged to it, then from the one that enqueued
+	 */
+	if (q->host_mem_pct && cake_mem_side(q) != CAKE_MEM_NONE) {
+		u32 quota = div_u64((u64)q->buffer_limit * q->host_mem_pct, 100);
+		u8 side = cake_mem_side(q);
+		u16 host = side == CAKE_MEM_DSTHOST ? flow->dsthost :
+						      flow->srchost;
+		struct cake_host *h = &b->hosts[host];
+		u32 *mem = side == CAKE_MEM_DSTHOST ? &h->dsthost_mem :
+						      &h->srchost_mem;
+		u16 victim = side == CAKE_MEM_DSTHOST ? h->dsthost_victim :
+							h->srchost_victim;
+		struct cake_tin_data *vb = &q->tins[victim / CAKE_QUEUES];
+		u32 vidx = victim % CAKE_QUEUES;
+		int pass;
+
+		for (pass = 0; pass < 2 && *mem > quota; pass++) {
+			while (*mem > quota &&
+			       cake_head_charged_to(&vb->flows[vidx], side,
+						    host)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+				cake_drop_flow_head(sch, vb, vidx, now);
+#else
+				cake_drop_flow_head(sch, vb, vidx, now,
+						    to_free);
+#endif
+				vb->drop_overlimit++;
+			}
+			vb = b;
+			vidx = idx;
 		}
-		flow->set = CAKE_SET_SPARSE;
-		b->sparse_flow_count++;
-
-		if (cake_dsrc(q->flow_mode))
-			host_load = max(host_load, srchost->srchost_bulk_flow_count);
-
-		if (cake_ddst(q->flow_mode))
-			host_load = max(host_load, dsthost->dsthost_bulk_flow_count);
-
-		flow->deficit = (b->flow_quantum *
-				 quantum_div[host_load]) >> 16;
-	} else if (flow->set == CAKE_SET_SPARSE_WAIT) {
-		struct cake_host *srchost = &b->hosts[flow->srchost];
-		struct cake_host *dsthost = &b->hosts[flow->dsthost];
-
-		/* this flow was empty, accounted as a sparse flow, but actually
-		 * in the bulk rotation.
-		 */
-		flow->set = CAKE_SET_BULK;
-		b->sparse_flow_count--;
-		b->bulk_flow_count++;
-
-		if (cake_dsrc(q->flow_mode))
-			srchost->srchost_bulk_flow_count++;
-
-		if (cake_ddst(q->flow_mode))
-			dsthost->dsthost_bulk_flow_count++;
-
 	}
 
 	if (q->buffer_used > q->buffer_max_used)
@@ -1955,9 +2695,9 @@ static s32 cake_enqueue(struct sk_buff *skb, struct Qdisc *sch,
 		while (q->buffer_used > q->buffer_limit) {
 			dropped++;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-			cake_drop(sch);
+			cake_drop(sch, now);
 #else
-			cake_drop(sch, to_free);
+			cake_drop(sch, now, to_free);
 #endif
 		}
 		b->drop_overlimit += dropped;
@@ -1981,6 +2721,7 @@ static struct sk_buff *cake_dequeue_one(struct Qdisc *sch)
 		sch->qstats.backlog      -= len;
 		q->buffer_used		 -= skb->truesize;
 		sch->q.qlen--;
+		cake_mem_uncharge(q, b, flow, skb);
 
 		if (q->overflow_timeout)
 			cake_heapify(q, b->overflow_idx[q->cur_flow]);
@@ -1988,6 +2729,124 @@ static struct sk_buff *cake_dequeue_one(struct Qdisc *sch)
 	return skb;
 }
 
+/* Segment the GSO packet at the head of a flow in place, carrying over its
+ * enqueue time so the segments keep the sojourn of the original.
+ */
+static void cake_split_gso_head(struct Qdisc *sch, struct cake_tin_data *b,
+				struct cake_flow *flow)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = flow->head, *segs, *nskb, *last = NULL;
+	netdev_features_t features = netif_skb_features(skb);
+	ktime_t enqueue_time = cobalt_get_enqueue_time(skb);
+	unsigned int len = qdisc_pkt_len(skb);
+	unsigned int slen = 0, numsegs = 0;
+	u32 idx = flow - b->flows;
+	u32 truesize = 0;
+
+	segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR_OR_NULL(segs))
+		return; /* deliver it whole */
+
+	for (nskb = segs; nskb; last = nskb, nskb = nskb->next) {
+		qdisc_skb_cb(nskb)->pkt_len = nskb->len;
+		cobalt_set_enqueue_time(nskb, enqueue_time);
+		get_cobalt_cb(nskb)->adjusted_len = cake_overhead(q, nskb);
+		cake_mem_charge(q, b, flow, nskb);
+
+		numsegs++;
+		slen += nskb->len;
+		truesize += nskb->truesize;
+	}
+
+	last->next = skb->next;
+	if (flow->tail == skb)
+		flow->tail = last;
+	flow->head = segs;
+
+	sch->q.qlen         += numsegs - 1;
+	q->buffer_used      += truesize - skb->truesize;
+	cake_mem_uncharge(q, b, flow, skb);
+	b->packets          += numsegs - 1;
+	b->bytes            += slen - len;
+	b->backlogs[idx]    += slen - len;
+	b->tin_backlog      += slen - len;
+	sch->qstats.backlog += slen - len;
+
+	if (q->overflow_timeout && slen > len)
+		cake_heapify_up(q, b->overflow_idx[idx]);
+
+	qdisc_tree_reduce_backlog(sch, 1 - numsegs, len - slen);
+	consume_skb(skb);
+}
+
+/* The number of intervals elapsed since the heavy hitter counts were last
+ * halved, each owing one more halving.  Past 31 every count is gone.
+ */
+static u32 cake_heavy_shift(const struct cake_tin_data *b, ktime_t now)
+{
+	s64 elapsed = ktime_to_ns(ktime_sub(now, b->heavy_decay_time));
+	u64 interval = max_t(u64, b->cparams.interval, 1);
+
+	if (elapsed <= 0)
+		return 0;
+
+	return min_t(u64, div64_u64(elapsed, interval), 32);
+}
+
+static u32 cake_heavy_bytes(u32 bytes, u32 shift)
+{
+	return shift < 32 ? bytes >> shift : 0;
+}
+
+/* Count bytes sent by a flow into the tin's heavy hitter summary.  A flow not
+ * yet tracked replaces the smallest entry and inherits its count, so the table
+ * overestimates but never misses a flow sending more than 1/CAKE_HEAVY_FLOWS
+ * of the recent bytes.  Slots are matched on tag as well, since cake_hash may
+ * have handed the slot to another flow since it was counted.
+ */
+static void cake_heavy_update(struct cake_tin_data *b, u16 idx, u32 len,
+			      ktime_t now)
+{
+	struct cake_heavy_entry *e, *min = NULL;
+	u32 shift = cake_heavy_shift(b, now);
+	u32 tag = b->tags[idx];
+	int i;
+
+	if (shift) {
+		for (i = 0; i < b->heavy_cnt; i++)
+			b->heavy[i].bytes = cake_heavy_bytes(b->heavy[i].bytes,
+							     shift);
+		b->heavy_decay_time = shift < 32 ?
+			ktime_add_ns(b->heavy_decay_time,
+				     shift * b->cparams.interval) : now;
+	}
+
+	for (i = 0; i < b->heavy_cnt; i++) {
+		e = &b->heavy[i];
+		if (e->flow == idx) {
+			if (e->tag != tag) {
+				e->tag = tag;
+				e->bytes = 0;
+			}
+			e->bytes += len;
+			return;
+		}
+		if (!min || e->bytes < min->bytes)
+			min = e;
+	}
+
+	if (b->heavy_cnt < CAKE_HEAVY_FLOWS) {
+		e = &b->heavy[b->heavy_cnt++];
+		e->bytes = 0;
+	} else {
+		e = min;
+	}
+	e->flow = idx;
+	e->tag = tag;
+	e->bytes += len;
+}
+
 /* Discard leftover packets from a tin no longer in use. */
 static void cake_clear_tin(struct Qdisc *sch, u16 tin)
 {
@@ -1998,23 +2857,162 @@ static void cake_clear_tin(struct Qdisc *sch, u16 tin)
 	for (q->cur_flow = 0; q->cur_flow < CAKE_QUEUES; q->cur_flow++)
 		while (!!(skb = cake_dequeue_one(sch)))
 			kfree_skb(skb);
+
+	q->tins[tin].heavy_cnt = 0;
+}
+
+/* Take an empty flow of a tin going out of use off its flowchain, so the
+ * tin is not scheduled again and its bulk flow count does not linger in the
+ * host table.  The decrement saturates, as the flow mode may have changed
+ * since it was counted.
+ */
+static void cake_retire_flow(struct cake_sched_data *q,
+			     struct cake_tin_data *b, struct cake_flow *flow)
+{
+	struct cake_host *srchost = &b->hosts[flow->srchost];
+	struct cake_host *dsthost = &b->hosts[flow->dsthost];
+
+	if (flow->set == CAKE_SET_BULK) {
+		if (cake_dsrc(q->flow_mode) && srchost->srchost_bulk_flow_count)
+			srchost->srchost_bulk_flow_count--;
+
+		if (cake_ddst(q->flow_mode) && dsthost->dsthost_bulk_flow_count)
+			dsthost->dsthost_bulk_flow_count--;
+	}
+
+	flow->set = CAKE_SET_NONE;
+	list_del_init(&flow->flowchain);
+}
+
+/* Move the packets of a tin no longer in use into the tins the current
+ * configuration would have given them.  Each packet keeps its enqueue time and
+ * per-flow ordering is preserved.  Tin selection uses the codepoint, mark and
+ * priority only, since rerunning filter actions on queued packets is not safe.
+ * The old tin is left with no flows scheduled and nothing counted.
+ */
+static void cake_migrate_tin(struct Qdisc *sch, u16 tin, ktime_t now)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	struct cake_tin_data *from = &q->tins[tin];
+	struct cake_tin_data *b;
+	struct cake_flow *flow;
+	struct sk_buff *skb;
+	u32 idx, len;
+	int j;
+
+	from->heavy_cnt = 0;
+
+	for (j = 0; j < CAKE_QUEUES; j++) {
+		while (from->tin_backlog && from->flows[j].head) {
+			skb = dequeue_head(&from->flows[j]);
+			len = qdisc_pkt_len(skb);
+			from->backlogs[j]  -= len;
+			from->tin_backlog  -= len;
+			cake_mem_uncharge(q, from, &from->flows[j], skb);
+
+			if (q->overflow_timeout)
+				cake_heapify(q, from->overflow_idx[j]);
+
+			b = cake_select_tin(sch, skb, 0);
+			idx = cake_hash(b, skb, q->flow_mode, 0, 0, now);
+			flow = &b->flows[idx];
+
+			if (!b->tin_backlog &&
+			    ktime_before(b->time_next_packet, now))
+				b->time_next_packet = now;
+
+			flow_queue_add(flow, skb);
+			b->backlogs[idx] += len;
+			b->tin_backlog   += len;
+			cake_mem_charge(q, b, flow, skb);
+
+			if (q->overflow_timeout)
+				cake_heapify_up(q, b->overflow_idx[idx]);
+
+			cake_activate_flow(q, b, flow, now);
+		}
+
+		cake_retire_flow(q, from, &from->flows[j]);
+	}
+
+	from->sparse_flow_count = 0;
+	from->bulk_flow_count = 0;
+	from->unresponsive_flow_count = 0;
+	from->tin_deficit = 0;
+	q->active_tins &= ~BIT(tin);
+}
+
+/* Egress autorate: adapt the shaper to a bottleneck further downstream.  The
+ * congestion signal is the queueing delay reported through
+ * TCA_CAKE_AUTORATE_FEEDBACK_US by an external probe; the load signal is the
+ * minimum local sojourn over an interval, which only stays above target while
+ * the shaper itself is the bottleneck.  Once per interval, back off by 1/8
+ * when the downstream delay exceeds target, otherwise probe upwards by a
+ * fixed step while there is a standing local queue.  Each report is acted on
+ * once, and only within 4 intervals of arriving; without one the rate is
+ * held, since there is nothing to protect the downstream queue.
+ */
+static void cake_autorate_egress(struct Qdisc *sch, u64 delay, ktime_t now)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	u64 interval_ns = us_to_ns(q->interval);
+	u64 target_ns = us_to_ns(q->target);
+	u64 lo = max_t(u64, q->autorate_min_bps, 64);
+	u64 hi = q->autorate_max_bps ?: U64_MAX;
+	u64 rate = q->rate_bps;
+	bool fresh;
+
+	q->egress_sojourn_min = min(q->egress_sojourn_min, delay);
+
+	if (ktime_to_ns(ktime_sub(now, q->egress_period_begin)) < interval_ns)
+		return;
+
+	fresh = !q->feedback_used &&
+		ktime_to_ns(ktime_sub(now, q->feedback_time)) <
+		4 * interval_ns;
+
+	if (fresh && q->feedback_delay_ns > target_ns)
+		rate -= rate >> 3;
+	else if (fresh && q->egress_sojourn_min > target_ns)
+		rate += max_t(u64, (hi == U64_MAX ? rate : hi) >> 6, 1);
+
+	if (fresh)
+		q->feedback_used = true;
+
+	rate = clamp(rate, lo, hi);
+
+	q->egress_period_begin = now;
+	q->egress_sojourn_min = U64_MAX;
+
+	if (rate != q->rate_bps) {
+		q->rate_bps = rate;
+		q->avg_peak_bandwidth = rate;
+		cake_configure_rates(sch);
+	}
 }
 
 static struct sk_buff *cake_dequeue(struct Qdisc *sch)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
 	struct cake_tin_data *b = &q->tins[q->cur_tin];
+	ktime_t host_wait = ns_to_ktime(KTIME_MAX);
 	struct cake_host *srchost, *dsthost;
 	ktime_t now = ktime_get();
+	ktime_t *host_next;
 	struct cake_flow *flow;
 	struct list_head *head;
-	bool first_flow = true;
+	u32 blocked_tins = 0;
+	u32 host_blocked;
 	struct sk_buff *skb;
 	u16 host_load;
 	u64 delay;
 	u32 len;
 
 begin:
+	/* counted afresh for whichever tin is chosen below */
+	host_blocked = 0;
+	host_next = NULL;
+
 	if (!sch->q.qlen)
 		return NULL;
 
@@ -2037,10 +3035,12 @@ begin:
 		bool wrapped = false, empty = true;
 
 		while (b->tin_deficit < 0 ||
-		       !(b->sparse_flow_count + b->bulk_flow_count)) {
+		       !(b->sparse_flow_count + b->bulk_flow_count) ||
+		       blocked_tins & BIT(q->cur_tin)) {
 			if (b->tin_deficit <= 0)
 				b->tin_deficit += b->tin_quantum;
-			if (b->sparse_flow_count + b->bulk_flow_count)
+			if (b->sparse_flow_count + b->bulk_flow_count &&
+			    !(blocked_tins & BIT(q->cur_tin)))
 				empty = false;
 
 			q->cur_tin++;
@@ -2054,7 +3054,7 @@ begin:
 					 * we actually have no packets anywhere.
 					 */
 					if (empty)
-						return NULL;
+						goto host_sleep;
 				} else {
 					wrapped = true;
 				}
@@ -2066,20 +3066,34 @@ begin:
 		 * - The earliest-scheduled tin with queue.
 		 */
 		ktime_t best_time = ns_to_ktime(KTIME_MAX);
+		u32 active = q->active_tins & ~blocked_tins;
 		int tin, best_tin = 0;
 
-		for (tin = 0; tin < q->tin_cnt; tin++) {
+		/* Visit only tins flagged active, highest index first, so the
+		 * first one meeting its schedule can be taken immediately.
+		 * Tins found empty are unflagged until their next enqueue.
+		 */
+		while (active) {
+			ktime_t time_to_pkt;
+
+			tin = fls(active) - 1;
+			active &= ~BIT(tin);
 			b = q->tins + tin;
-			if ((b->sparse_flow_count + b->bulk_flow_count) > 0) {
-				ktime_t time_to_pkt = \
-					ktime_sub(b->time_next_packet, now);
-
-				if (ktime_to_ns(time_to_pkt) <= 0 ||
-				    ktime_compare(time_to_pkt,
-						  best_time) <= 0) {
-					best_time = time_to_pkt;
-					best_tin = tin;
-				}
+
+			if (!(b->sparse_flow_count + b->bulk_flow_count)) {
+				q->active_tins &= ~BIT(tin);
+				continue;
+			}
+
+			time_to_pkt = ktime_sub(b->time_next_packet, now);
+			if (ktime_to_ns(time_to_pkt) <= 0) {
+				best_tin = tin;
+				break;
+			}
+
+			if (ktime_compare(time_to_pkt, best_time) < 0) {
+				best_time = time_to_pkt;
+				best_tin = tin;
 			}
 		}
 
@@ -2087,27 +3101,21 @@ begin:
 		b = q->tins + best_tin;
 
 		/* No point in going further if no packets to deliver. */
-		if (unlikely(!(b->sparse_flow_count + b->bulk_flow_count)))
-			return NULL;
+		if (unlikely(!(b->sparse_flow_count + b->bulk_flow_count) ||
+			     blocked_tins & BIT(best_tin)))
+			goto host_sleep;
 	}
 
 retry:
 	/* service this class */
-	head = &b->decaying_flows;
-	if (!first_flow || list_empty(head)) {
-		head = &b->new_flows;
-		if (list_empty(head)) {
-			head = &b->old_flows;
-			if (unlikely(list_empty(head))) {
-				head = &b->decaying_flows;
-				if (unlikely(list_empty(head)))
-					goto begin;
-			}
-		}
+	head = &b->new_flows;
+	if (list_empty(head)) {
+		head = &b->old_flows;
+		if (unlikely(list_empty(head)))
+			goto begin;
 	}
 	flow = list_first_entry(head, struct cake_flow, flowchain);
 	q->cur_flow = flow - b->flows;
-	first_flow = false;
 
 	/* triple isolation (modified DRR++) */
 	srchost = &b->hosts[flow->srchost];
@@ -2116,10 +3124,7 @@ retry:
 
 	/* flow isolation (DRR++) */
 	if (flow->deficit <= 0) {
-		/* Keep all flows with deficits out of the sparse and decaying
-		 * rotations.  No non-empty flow can go into the decaying
-		 * rotation, so they can't get deficits
-		 */
+		/* Keep all flows with deficits out of the sparse rotation */
 		if (flow->set == CAKE_SET_SPARSE) {
 			if (flow->head) {
 				b->sparse_flow_count--;
@@ -2147,7 +3152,9 @@ retry:
 		if (cake_ddst(q->flow_mode))
 			host_load = max(host_load, dsthost->dsthost_bulk_flow_count);
 
-		WARN_ON(host_load > CAKE_QUEUES);
+		/* bulk flows are counted across all tins */
+		WARN_ON_ONCE(host_load > CAKE_MAX_TINS * CAKE_QUEUES);
+		host_load = min_t(u16, host_load, CAKE_QUEUES);
 
 		/* The shifted prandom_u32() is a way to apply dithering to
 		 * avoid accumulating roundoff errors
@@ -2159,57 +3166,67 @@ retry:
 		goto retry;
 	}
 
+	/* per-host rate cap: skip flows of hosts over their rate.  If every flow
+	 * in the tin is held back, try the other tins, and only once none can
+	 * send sleep until the first host is due.  host_wait is the earliest
+	 * such time over all the tins tried.
+	 */
+	if (q->host_rate_ns && flow->head) {
+		host_next = cake_host_time_next(q, b, flow);
+
+		if (host_next && ktime_after(*host_next, now)) {
+			if (ktime_before(*host_next, host_wait))
+				host_wait = *host_next;
+			list_move_tail(&flow->flowchain, &b->old_flows);
+
+			if (++host_blocked <= b->sparse_flow_count +
+					      b->bulk_flow_count)
+				goto retry;
+
+			blocked_tins |= BIT(q->cur_tin);
+			goto begin;
+		}
+	}
+
 	/* Retrieve a packet via the AQM */
 	while (1) {
+		/* Lazy GSO splitting: only pay for segmentation when the
+		 * shaper has other traffic that a super-packet would delay.
+		 */
+		if (q->rate_flags & CAKE_FLAG_SPLIT_GSO_LAZY && q->rate_ns &&
+		    flow->head && skb_is_gso(flow->head) &&
+		    (b->sparse_flow_count + b->bulk_flow_count > 1 ||
+		     q->active_tins & ~BIT(q->cur_tin)))
+			cake_split_gso_head(sch, b, flow);
+
 		skb = cake_dequeue_one(sch);
 		if (!skb) {
 			/* this queue was actually empty */
 			if (cobalt_queue_empty(&flow->cvars, &b->cparams, now))
 				b->unresponsive_flow_count--;
 
-			if (flow->cvars.p_drop || flow->cvars.count ||
-			    ktime_before(now, flow->cvars.drop_next)) {
-				/* keep in the flowchain until the state has
-				 * decayed to rest
-				 */
-				list_move_tail(&flow->flowchain,
-					       &b->decaying_flows);
-				if (flow->set == CAKE_SET_BULK) {
-					b->bulk_flow_count--;
-
-					if (cake_dsrc(q->flow_mode))
-						srchost->srchost_bulk_flow_count--;
-
-					if (cake_ddst(q->flow_mode))
-						dsthost->dsthost_bulk_flow_count--;
-
-					b->decaying_flow_count++;
-				} else if (flow->set == CAKE_SET_SPARSE ||
-					   flow->set == CAKE_SET_SPARSE_WAIT) {
-					b->sparse_flow_count--;
-					b->decaying_flow_count++;
-				}
-				flow->set = CAKE_SET_DECAYING;
-			} else {
-				/* remove empty queue from the flowchain */
-				list_del_init(&flow->flowchain);
-				if (flow->set == CAKE_SET_SPARSE ||
-				    flow->set == CAKE_SET_SPARSE_WAIT)
-					b->sparse_flow_count--;
-				else if (flow->set == CAKE_SET_BULK) {
-					b->bulk_flow_count--;
-
-					if (cake_dsrc(q->flow_mode))
-						srchost->srchost_bulk_flow_count--;
+			/* Remove the empty queue from the flowchain.  Any AQM
+			 * state left is decayed when it next becomes active,
+			 * and until then it no longer counts as unresponsive.
+			 */
+			if (flow->cvars.p_drop)
+				b->unresponsive_flow_count--;
 
-					if (cake_ddst(q->flow_mode))
-						dsthost->dsthost_bulk_flow_count--;
+			list_del_init(&flow->flowchain);
+			if (flow->set == CAKE_SET_SPARSE ||
+			    flow->set == CAKE_SET_SPARSE_WAIT) {
+				b->sparse_flow_count--;
+			} else if (flow->set == CAKE_SET_BULK) {
+				b->bulk_flow_count--;
 
-				} else
-					b->decaying_flow_count--;
+				if (cake_dsrc(q->flow_mode))
+					srchost->srchost_bulk_flow_count--;
 
-				flow->set = CAKE_SET_NONE;
+				if (cake_ddst(q->flow_mode))
+					dsthost->dsthost_bulk_flow_count--;
 			}
+
+			flow->set = CAKE_SET_NONE;
 			goto begin;
 		}
 
@@ -2227,6 +3244,8 @@ retry:
 						  now, true);
 			flow->deficit -= len;
 			b->tin_deficit -= len;
+			if (host_next)
+				cake_advance_host(q, b, host_next, len, now);
 		}
 		b->tin_dropped++;
 		qdisc_tree_reduce_backlog(sch, 1, qdisc_pkt_len(skb));
@@ -2241,6 +3260,7 @@ retry:
 	}
 
 	b->tin_ecn_mark += !!flow->cvars.ecn_marked;
+	b->tin_sce_mark += !!flow->cvars.sce_marked;
 	qdisc_bstats_update(sch, skb);
 
 	/* collect delay stats */
@@ -2251,42 +3271,56 @@ retry:
 	b->base_delay = cake_ewma(b->base_delay, delay,
 				  delay < b->base_delay ? 2 : 8);
 
+	/* L4S step marking: scalable senders respond to every mark, so signal
+	 * as soon as the shallow queue builds instead of waiting an interval.
+	 * COBALT stays in charge as the overload backstop.
+	 */
+	if (q->cur_tin == q->l4s_tin && delay > q->l4s_step_ns &&
+	    !flow->cvars.ecn_marked && cake_get_ecn(skb) == INET_ECN_ECT_1 &&
+	    INET_ECN_set_ce(skb))
+		b->tin_ecn_mark++;
+
 	len = cake_advance_shaper(q, b, skb, now, false);
 	flow->deficit -= len;
 	b->tin_deficit -= len;
+	if (host_next)
+		cake_advance_host(q, b, host_next, len, now);
+
+	cake_heavy_update(b, q->cur_flow, qdisc_pkt_len(skb), now);
+
+	if ((q->rate_flags & CAKE_FLAG_AUTORATE_EGRESS) && q->rate_bps)
+		cake_autorate_egress(sch, delay, now);
 
 	if (ktime_after(q->time_next_packet, now) && sch->q.qlen) {
 		u64 next = min(ktime_to_ns(q->time_next_packet),
 			       ktime_to_ns(q->failsafe_next_packet));
 
 		qdisc_watchdog_schedule_ns(&q->watchdog, next);
-	} else if (!sch->q.qlen) {
-		int i;
-
-		for (i = 0; i < q->tin_cnt; i++) {
-			if (q->tins[i].decaying_flow_count) {
-				ktime_t next = \
-					ktime_add_ns(now,
-						     q->tins[i].cparams.target);
-
-				qdisc_watchdog_schedule_ns(&q->watchdog,
-							   ktime_to_ns(next));
-				break;
-			}
-		}
 	}
 
 	if (q->overflow_timeout)
 		q->overflow_timeout--;
 
 	return skb;
+
+host_sleep:
+	/* nothing eligible; if hosts over their rate held tins back, wake up
+	 * when the first of them is due
+	 */
+	if (blocked_tins) {
+		sch->qstats.overlimits++;
+		qdisc_watchdog_schedule_ns(&q->watchdog,
+					   ktime_to_ns(host_wait));
+	}
+	return NULL;
 }
 
 static void cake_reset(struct Qdisc *sch)
 {
+	struct cake_sched_data *q = qdisc_priv(sch);
 	u32 c;
 
-	for (c = 0; c < CAKE_MAX_TINS; c++)
+	for (c = 0; c < q->tin_alloc; c++)
 		cake_clear_tin(sch, c);
 }
 
@@ -2306,31 +3340,63 @@ static const struct nla_policy cake_policy[TCA_CAKE_MAX + 1] = {
 	[TCA_CAKE_MPU]		 = { .type = NLA_U32 },
 	[TCA_CAKE_INGRESS]	 = { .type = NLA_U32 },
 	[TCA_CAKE_ACK_FILTER]	 = { .type = NLA_U32 },
+	[TCA_CAKE_SPLIT_GSO]	 = { .type = NLA_U32 },
 	[TCA_CAKE_FWMARK]	 = { .type = NLA_U32 },
+	[TCA_CAKE_BPF_FD]	 = { .type = NLA_S32 },
+	[TCA_CAKE_DSCP_MAP]	 = { .type = NLA_BINARY, .len = 64 },
+	[TCA_CAKE_TIN_PARAMS]	 = { .type = NLA_BINARY,
+				     .len = CAKE_MAX_TINS *
+					    sizeof(struct tc_cake_tin_params) },
+	[TCA_CAKE_HOST_RATE64]	 = { .type = NLA_U64 },
+	[TCA_CAKE_AUTORATE_ESTIMATOR] = { .type = NLA_U32 },
+	[TCA_CAKE_AUTORATE_EGRESS] = { .type = NLA_U32 },
+	[TCA_CAKE_AUTORATE_MIN64] = { .type = NLA_U64 },
+	[TCA_CAKE_AUTORATE_MAX64] = { .type = NLA_U64 },
+	[TCA_CAKE_AUTORATE_FEEDBACK_US] = { .type = NLA_U32 },
+	[TCA_CAKE_L4S]		 = { .type = NLA_U32 },
+	[TCA_CAKE_SCE]		 = { .type = NLA_U32 },
+	[TCA_CAKE_TIN_AQM]	 = { .type = NLA_BINARY,
+				     .len = CAKE_MAX_TINS *
+					    sizeof(struct tc_cake_tin_aqm) },
+	[TCA_CAKE_HEAD_DROP]	 = { .type = NLA_U32 },
+	[TCA_CAKE_HOST_MEM_PCT]	 = { .type = NLA_U32 },
+	[TCA_CAKE_COMPACT]	 = { .type = NLA_U32 },
+	[TCA_CAKE_MEMORY_PEAK_RESET] = { .type = NLA_U32 },
+	[TCA_CAKE_FLOW_KEYS]	 = { .type = NLA_U32 },
 };
 
-static void cake_set_rate(struct cake_tin_data *b, u64 rate, u32 mtu,
-			  u64 target_ns, u64 rtt_est_ns)
+static u64 cake_rate_ns(u64 rate, u16 *rate_shft)
 {
 	/* convert byte-rate into time-per-byte
 	 * so it will always unwedge in reasonable time.
 	 */
 	static const u64 MIN_RATE = 64;
+	u16 shft = 34;
+	u64 rate_ns;
+
+	rate_ns = ((u64)NSEC_PER_SEC) << shft;
+	rate_ns = div64_u64(rate_ns, max(MIN_RATE, rate));
+	while (!!(rate_ns >> 34)) {
+		rate_ns >>= 1;
+		shft--;
+	}
+
+	*rate_shft = shft;
+	return rate_ns;
+}
+
+static void cake_set_rate(struct cake_tin_data *b, u64 rate, u32 mtu,
+			  u64 target_ns, u64 rtt_est_ns)
+{
 	u32 byte_target = mtu;
 	u64 byte_target_ns;
-	u8  rate_shft = 0;
+	u16 rate_shft = 0;
 	u64 rate_ns = 0;
 
 	b->flow_quantum = 1514;
 	if (rate) {
 		b->flow_quantum = max(min(rate >> 12, 1514ULL), 300ULL);
-		rate_shft = 34;
-		rate_ns = ((u64)NSEC_PER_SEC) << rate_shft;
-		rate_ns = div64_u64(rate_ns, max(MIN_RATE, rate));
-		while (!!(rate_ns >> 34)) {
-			rate_ns >>= 1;
-			rate_shft--;
-		}
+		rate_ns = cake_rate_ns(rate, &rate_shft);
 	} /* else unlimited, ie. zero delay */
 
 	b->tin_rate_bps  = rate;
@@ -2348,31 +3414,25 @@ static void cake_set_rate(struct cake_tin_data *b, u64 rate, u32 mtu,
 	b->cparams.p_dec = 1 << 20; /* 1/4096 */
 }
 
-static int cake_config_besteffort(struct Qdisc *sch)
+static void cake_config_besteffort(struct Qdisc *sch)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
 	struct cake_tin_data *b = &q->tins[0];
-	u32 mtu = psched_mtu(qdisc_dev(sch));
-	u64 rate = q->rate_bps;
 
 	q->tin_cnt = 1;
 
 	q->tin_index = besteffort;
 	q->tin_order = normal_order;
 
-	cake_set_rate(b, rate, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
+	b->tin_rate_frac = CAKE_RATE_FRAC_ONE;
 	b->tin_quantum = 65535;
-
-	return 0;
 }
 
-static int cake_config_precedence(struct Qdisc *sch)
+static void cake_config_precedence(struct Qdisc *sch)
 {
 	/* convert high-level (user visible) parameters into internal format */
 	struct cake_sched_data *q = qdisc_priv(sch);
-	u32 mtu = psched_mtu(qdisc_dev(sch));
-	u64 rate = q->rate_bps;
+	u32 frac = CAKE_RATE_FRAC_ONE;
 	u32 quantum = 256;
 	u32 i;
 
@@ -2383,20 +3443,16 @@ static int cake_config_precedence(struct Qdisc *sch)
 	for (i = 0; i < q->tin_cnt; i++) {
 		struct cake_tin_data *b = &q->tins[i];
 
-		cake_set_rate(b, rate, mtu, us_to_ns(q->target),
-			      us_to_ns(q->interval));
-
+		b->tin_rate_frac = frac;
 		b->tin_quantum = max_t(u16, 1U, quantum);
 
 		/* calculate next class's parameters */
-		rate  *= 7;
-		rate >>= 3;
+		frac  *= 7;
+		frac >>= 3;
 
 		quantum  *= 7;
 		quantum >>= 3;
 	}
-
-	return 0;
 }
 
 /*	List of known Diffserv codepoints:
@@ -2443,7 +3499,7 @@ static int cake_config_precedence(struct Qdisc *sch)
  *	Total 12 traffic classes.
  */
 
-static int cake_config_diffserv8(struct Qdisc *sch)
+static void cake_config_diffserv8(struct Qdisc *sch)
 {
 /*	Pruned list of traffic classes for typical applications:
  *
@@ -2460,8 +3516,7 @@ static int cake_config_diffserv8(struct Qdisc *sch)
  */
 
 	struct cake_sched_data *q = qdisc_priv(sch);
-	u32 mtu = psched_mtu(qdisc_dev(sch));
-	u64 rate = q->rate_bps;
+	u32 frac = CAKE_RATE_FRAC_ONE;
 	u32 quantum = 256;
 	u32 i;
 
@@ -2475,23 +3530,19 @@ static int cake_config_diffserv8(struct Qdisc *sch)
 	for (i = 0; i < q->tin_cnt; i++) {
 		struct cake_tin_data *b = &q->tins[i];
 
-		cake_set_rate(b, rate, mtu, us_to_ns(q->target),
-			      us_to_ns(q->interval));
-
+		b->tin_rate_frac = frac;
 		b->tin_quantum = max_t(u16, 1U, quantum);
 
 		/* calculate next class's parameters */
-		rate  *= 7;
-		rate >>= 3;
+		frac  *= 7;
+		frac >>= 3;
 
 		quantum  *= 7;
 		quantum >>= 3;
 	}
-
-	return 0;
 }
 
-static int cake_config_diffserv4(struct Qdisc *sch)
+static void cake_config_diffserv4(struct Qdisc *sch)
 {
 /*  Further pruned list of traffic classes for four-class system:
  *
@@ -2504,8 +3555,6 @@ static int cake_config_diffserv4(struct Qdisc *sch)
  */
 
 	struct cake_sched_data *q = qdisc_priv(sch);
-	u32 mtu = psched_mtu(qdisc_dev(sch));
-	u64 rate = q->rate_bps;
 	u32 quantum = 1024;
 
 	q->tin_cnt = 4;
@@ -2515,25 +3564,19 @@ static int cake_config_diffserv4(struct Qdisc *sch)
 	q->tin_order = bulk_order;
 
 	/* class characteristics */
-	cake_set_rate(&q->tins[0], rate, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
-	cake_set_rate(&q->tins[1], rate >> 4, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
-	cake_set_rate(&q->tins[2], rate >> 1, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
-	cake_set_rate(&q->tins[3], rate >> 2, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
+	q->tins[0].tin_rate_frac = CAKE_RATE_FRAC_ONE;
+	q->tins[1].tin_rate_frac = CAKE_RATE_FRAC_ONE >> 4;
+	q->tins[2].tin_rate_frac = CAKE_RATE_FRAC_ONE >> 1;
+	q->tins[3].tin_rate_frac = CAKE_RATE_FRAC_ONE >> 2;
 
 	/* bandwidth-sharing weights */
 	q->tins[0].tin_quantum = quantum;
 	q->tins[1].tin_quantum = quantum >> 4;
 	q->tins[2].tin_quantum = quantum >> 1;
 	q->tins[3].tin_quantum = quantum >> 2;
-
-	return 0;
 }
 
-static int cake_config_diffserv3(struct Qdisc *sch)
+static void cake_config_diffserv3(struct Qdisc *sch)
 {
 /*  Simplified Diffserv structure with 3 tins.
  *		Low Priority		(CS1)
@@ -2541,8 +3584,6 @@ static int cake_config_diffserv3(struct Qdisc *sch)
  *		Latency Sensitive	(TOS4, VA, EF, CS6, CS7)
  */
 	struct cake_sched_data *q = qdisc_priv(sch);
-	u32 mtu = psched_mtu(qdisc_dev(sch));
-	u64 rate = q->rate_bps;
 	u32 quantum = 1024;
 
 	q->tin_cnt = 3;
@@ -2552,73 +3593,434 @@ static int cake_config_diffserv3(struct Qdisc *sch)
 	q->tin_order = bulk_order;
 
 	/* class characteristics */
-	cake_set_rate(&q->tins[0], rate, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
-	cake_set_rate(&q->tins[1], rate >> 4, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
-	cake_set_rate(&q->tins[2], rate >> 2, mtu,
-		      us_to_ns(q->target), us_to_ns(q->interval));
+	q->tins[0].tin_rate_frac = CAKE_RATE_FRAC_ONE;
+	q->tins[1].tin_rate_frac = CAKE_RATE_FRAC_ONE >> 4;
+	q->tins[2].tin_rate_frac = CAKE_RATE_FRAC_ONE >> 2;
 
 	/* bandwidth-sharing weights */
 	q->tins[0].tin_quantum = quantum;
 	q->tins[1].tin_quantum = quantum >> 4;
 	q->tins[2].tin_quantum = quantum >> 2;
+}
 
-	return 0;
+static void cake_config_custom(struct Qdisc *sch)
+{
+/*  Codepoint map and tin characteristics supplied at runtime through
+ *  TCA_CAKE_DSCP_MAP and TCA_CAKE_TIN_PARAMS.  The tin with the largest rate
+ *  fraction sets the global shaper, as the first tin does in the fixed modes.
+ */
+	struct cake_sched_data *q = qdisc_priv(sch);
+	u32 i;
+
+	if (!q->custom_tin_cnt || q->custom_tin_cnt > q->tin_alloc) {
+		cake_config_besteffort(sch);
+		return;
+	}
+
+	q->tin_cnt = q->custom_tin_cnt;
+
+	/* codepoint to class mapping */
+	q->tin_index = q->custom_index;
+	q->tin_order = normal_order;
+
+	/* class characteristics */
+	for (i = 0; i < q->tin_cnt; i++) {
+		const struct tc_cake_tin_params *p = &q->custom_tins[i];
+		struct cake_tin_data *b = &q->tins[i];
+
+		b->tin_rate_frac = p->rate_frac;
+		b->tin_quantum = p->quantum;
+	}
+}
+
+/* In automatic mode, split GSO packets only while a 64 KiB one would take
+ * longer than a quarter of the target to serialise at the shaped rate.  The
+ * 25% band between the on and off thresholds keeps autorate from flapping.
+ */
+static void cake_update_split_gso(struct cake_sched_data *q, u64 target_ns)
+{
+	u64 thresh;
+
+	if (!(q->rate_flags & CAKE_FLAG_SPLIT_GSO_AUTO))
+		return;
+
+	if (!q->rate_bps) {
+		q->rate_flags &= ~CAKE_FLAG_SPLIT_GSO;
+		return;
+	}
+
+	thresh = div64_u64((u64)GSO_LEGACY_MAX_SIZE * 4 * NSEC_PER_SEC,
+			   max_t(u64, target_ns, 1));
+
+	if (q->rate_flags & CAKE_FLAG_SPLIT_GSO) {
+		if (q->rate_bps > thresh + (thresh >> 2))
+			q->rate_flags &= ~CAKE_FLAG_SPLIT_GSO;
+	} else if (q->rate_bps < thresh) {
+		q->rate_flags |= CAKE_FLAG_SPLIT_GSO;
+	}
+}
+
+/* Derive everything that depends on rate_bps: per-tin shaper and AQM
+ * parameters, the global shaper and the default buffer limit.  Autorate calls
+ * this directly from the enqueue path, so it must not touch queue state.
+ */
+static void cake_configure_rates(struct Qdisc *sch)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	u32 mtu = psched_mtu(qdisc_dev(sch));
+	int i, c, ft = 0;
+
+	/* walk in priority order, which is how overrides are indexed */
+	for (i = 0; i < q->tin_cnt; i++) {
+		const struct tc_cake_tin_aqm *aqm = NULL;
+		u64 target_ns = us_to_ns(q->target);
+		u64 interval_ns = us_to_ns(q->interval);
+		struct cake_tin_data *b;
+
+		c = q->tin_order[i];
+		b = &q->tins[c];
+
+		if (i < q->tin_aqm_cnt)
+			aqm = &q->tin_aqm[i];
+		if (aqm && aqm->target_us)
+			target_ns = us_to_ns(aqm->target_us);
+		if (aqm && aqm->interval_us)
+			interval_ns = us_to_ns(aqm->interval_us);
+
+		cake_set_rate(b, mul_u64_u32_shr(q->rate_bps,
+						 b->tin_rate_frac, 16),
+			      mtu, target_ns, interval_ns);
+		b->cparams.sce_thresh = us_to_ns(q->sce_thresh_us);
+
+		if (aqm && aqm->p_inc)
+			b->cparams.p_inc = aqm->p_inc;
+		if (aqm && aqm->p_dec)
+			b->cparams.p_dec = aqm->p_dec;
+
+		if (b->tin_rate_frac > q->tins[ft].tin_rate_frac ||
+		    (b->tin_rate_frac == q->tins[ft].tin_rate_frac && c < ft))
+			ft = c;
+	}
+
+	for (c = q->tin_cnt; c < q->tin_alloc; c++)
+		q->tins[c].cparams.mtu_time = q->tins[ft].cparams.mtu_time;
+
+	if (q->l4s_tin < q->tin_cnt)
+		q->l4s_step_ns = max_t(u64, NSEC_PER_MSEC,
+				       q->tins[q->l4s_tin].cparams.mtu_time * 2);
+
+	/* the global shaper runs at the base rate, even if no custom tin is
+	 * given all of it
+	 */
+	q->rate_ns = 0;
+	q->rate_shft = 0;
+	if (q->rate_bps)
+		q->rate_ns = cake_rate_ns(q->rate_bps, &q->rate_shft);
+
+	cake_update_split_gso(q, q->tins[ft].cparams.target);
+
+	if (q->buffer_config_limit) {
+		q->buffer_limit = q->buffer_config_limit;
+	} else if (q->rate_bps) {
+		u64 t = q->rate_bps * q->interval;
+
+		do_div(t, USEC_PER_SEC / 4);
+		q->buffer_limit = max_t(u32, t, 4U << 20);
+	} else {
+		q->buffer_limit = ~0;
+	}
+
+	q->buffer_limit = min(q->buffer_limit,
+			      max(sch->limit * psched_mtu(qdisc_dev(sch)),
+				  q->buffer_config_limit));
 }
 
 static void cake_reconfigure(struct Qdisc *sch)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
-	int c, ft;
-
-	switch (q->tin_mode) {
-	case CAKE_DIFFSERV_BESTEFFORT:
-		ft = cake_config_besteffort(sch);
-		break;
+	ktime_t now = ktime_get();
+	int c;
+
+	switch (q->tin_mode) {
+	case CAKE_DIFFSERV_BESTEFFORT:
+		cake_config_besteffort(sch);
+		break;
+
+	case CAKE_DIFFSERV_PRECEDENCE:
+		cake_config_precedence(sch);
+		break;
+
+	case CAKE_DIFFSERV_DIFFSERV8:
+		cake_config_diffserv8(sch);
+		break;
+
+	case CAKE_DIFFSERV_DIFFSERV4:
+		cake_config_diffserv4(sch);
+		break;
+
+	case CAKE_DIFFSERV_CUSTOM:
+		cake_config_custom(sch);
+		break;
+
+	case CAKE_DIFFSERV_DIFFSERV3:
+	default:
+		cake_config_diffserv3(sch);
+		break;
+	}
+
+	/* The L4S tin goes after the classic ones, sharing the bandwidth like
+	 * the main class, with priority up to half the shaped rate so it can
+	 * neither starve the classic tins nor be starved by them.
+	 */
+	q->l4s_tin = CAKE_MAX_TINS;
+	if (q->rate_flags & CAKE_FLAG_L4S && q->tin_cnt < q->tin_alloc) {
+		struct cake_tin_data *b = &q->tins[q->tin_cnt];
+		u16 quantum = 1;
+
+		for (c = 0; c < q->tin_cnt; c++)
+			quantum = max(quantum, q->tins[c].tin_quantum);
+
+		b->tin_rate_frac = CAKE_RATE_FRAC_ONE >> 1;
+		b->tin_quantum = quantum;
+		q->l4s_tin = q->tin_cnt++;
+	}
+
+	/* the tin map is already switched; rehome what is queued elsewhere */
+	for (c = q->tin_cnt; c < q->tin_alloc; c++)
+		cake_migrate_tin(sch, c, now);
+
+	cake_configure_rates(sch);
+
+	q->host_rate_ns = 0;
+	if (q->host_rate_bps)
+		q->host_rate_ns = cake_rate_ns(q->host_rate_bps,
+					       &q->host_rate_shft);
+
+	sch->flags &= ~TCQ_F_CAN_BYPASS;
+}
+
+static u16 cake_tins_needed(u8 tin_mode, u16 custom_tin_cnt, bool l4s)
+{
+	u16 cnt = CAKE_DEFAULT_TINS;
+
+	if (tin_mode == CAKE_DIFFSERV_CUSTOM)
+		cnt = max_t(u16, custom_tin_cnt, cnt);
+
+	if (l4s)
+		cnt++;
+
+	return min_t(u16, cnt, CAKE_MAX_TINS);
+}
+
+static void cake_init_tin(struct cake_sched_data *q, struct cake_tin_data *b,
+			  struct cake_heap_entry *heap, u16 tin)
+{
+	int j;
+
+	b->perturb = prandom_u32();
+	b->hosts = q->hosts;
+	b->host_perturb = q->host_perturb;
+	INIT_LIST_HEAD(&b->new_flows);
+	INIT_LIST_HEAD(&b->old_flows);
+	b->sparse_flow_count = 0;
+	b->bulk_flow_count = 0;
+
+	for (j = 0; j < CAKE_QUEUES; j++) {
+		struct cake_flow *flow = b->flows + j;
+		u32 k = tin * CAKE_QUEUES + j;
+
+		INIT_LIST_HEAD(&flow->flowchain);
+		cobalt_vars_init(&flow->cvars);
+
+		heap[k].t = tin;
+		heap[k].b = j;
+		b->overflow_idx[j] = k;
+	}
+}
+
+/* Flow lists only ever link nodes within the tin array, so after copying the
+ * array every list pointer can be moved by the same offset.
+ */
+static void cake_rebase_list(struct list_head *l, const void *from, void *to)
+{
+	l->next = (struct list_head *)((char *)to +
+				       ((const char *)l->next -
+					(const char *)from));
+	l->prev = (struct list_head *)((char *)to +
+				       ((const char *)l->prev -
+					(const char *)from));
+}
+
+/* Tins beyond CAKE_DEFAULT_TINS are only allocated once a configuration asks
+ * for them.  Existing tins are carried over with their queued packets.
+ */
+static int cake_grow_tins(struct Qdisc *sch, u16 count)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	struct cake_heap_entry *heap, *old_heap;
+	struct cake_tin_data *tins, *old_tins;
+	int i, j;
+
+	if (count <= q->tin_alloc)
+		return 0;
+
+	tins = kvzalloc(count * sizeof(struct cake_tin_data), GFP_KERNEL);
+	heap = kvzalloc(count * CAKE_QUEUES * sizeof(struct cake_heap_entry),
+			GFP_KERNEL);
+	if (!tins || !heap) {
+		kvfree(tins);
+		kvfree(heap);
+		return -ENOMEM;
+	}
+
+	for (i = q->tin_alloc; i < count; i++)
+		cake_init_tin(q, tins + i, heap, i);
+
+	sch_tree_lock(sch);
+	old_tins = q->tins;
+	old_heap = q->overflow_heap;
+
+	memcpy(tins, old_tins, q->tin_alloc * sizeof(struct cake_tin_data));
+	memcpy(heap, old_heap,
+	       q->tin_alloc * CAKE_QUEUES * sizeof(struct cake_heap_entry));
+
+	for (i = 0; i < q->tin_alloc; i++) {
+		struct cake_tin_data *b = tins + i;
+
+		cake_rebase_list(&b->new_flows, old_tins, tins);
+		cake_rebase_list(&b->old_flows, old_tins, tins);
+		for (j = 0; j < CAKE_QUEUES; j++)
+			cake_rebase_list(&b->flows[j].flowchain,
+					 old_tins, tins);
+	}
+
+	q->tins = tins;
+	q->overflow_heap = heap;
+	q->tin_alloc = count;
+	sch_tree_unlock(sch);
+
+	kvfree(old_tins);
+	kvfree(old_heap);
+	return 0;
+}
+
+/* Turn the per-slot flow key arrays on or off for every tin.  All arrays are
+ * allocated before anything changes, so on failure the qdisc is left as it
+ * was.  Slots already in use have no key until they are next allocated.
+ */
+static int cake_set_flow_keys(struct Qdisc *sch, bool on)
+{
+	struct tc_cake_flow_key *keys[CAKE_MAX_TINS] = { NULL };
+	struct cake_sched_data *q = qdisc_priv(sch);
+	int i;
+
+	for (i = 0; on && i < q->tin_alloc; i++) {
+		if (q->tins[i].flow_keys)
+			continue;
+
+		keys[i] = kvzalloc(CAKE_QUEUES * sizeof(*keys[i]), GFP_KERNEL);
+		if (!keys[i])
+			goto nomem;
+	}
+
+	sch_tree_lock(sch);
+	for (i = 0; i < q->tin_alloc; i++)
+		if (!on || keys[i])
+			swap(q->tins[i].flow_keys, keys[i]);
+
+	if (on)
+		q->rate_flags |= CAKE_FLAG_FLOW_KEYS;
+	else
+		q->rate_flags &= ~CAKE_FLAG_FLOW_KEYS;
+	sch_tree_unlock(sch);
+
+	for (i = 0; i < q->tin_alloc; i++)
+		kvfree(keys[i]);
+	return 0;
+
+nomem:
+	for (i = 0; i < q->tin_alloc; i++)
+		kvfree(keys[i]);
+	return -ENOMEM;
+}
+
+/* Fast path for external rate controllers, which change the bandwidth or
+ * report probe feedback many times a second.  If those are the only
+ * attributes present, apply them without the full parse and reconfigure, so
+ * flow and tin state and the rest of the configuration are left alone.
+ * Returns false if the message needs the slow path.
+ */
+static bool cake_change_rate(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	struct nlattr *rate = NULL, *feedback = NULL;
+	struct nlattr *nla;
+	int rem;
 
-	case CAKE_DIFFSERV_PRECEDENCE:
-		ft = cake_config_precedence(sch);
-		break;
+	if (!q->tins)
+		return false;
 
-	case CAKE_DIFFSERV_DIFFSERV8:
-		ft = cake_config_diffserv8(sch);
-		break;
+	nla_for_each_nested(nla, opt, rem) {
+		switch (nla_type(nla)) {
+		case TCA_CAKE_BASE_RATE64:
+			if (nla_len(nla) != sizeof(u64))
+				return false;
+			rate = nla;
+			break;
+		case TCA_CAKE_AUTORATE_FEEDBACK_US:
+			if (nla_len(nla) != sizeof(u32))
+				return false;
+			feedback = nla;
+			break;
+		default:
+			return false;
+		}
+	}
 
-	case CAKE_DIFFSERV_DIFFSERV4:
-		ft = cake_config_diffserv4(sch);
-		break;
+	if ((!rate && !feedback) || rem)
+		return false;
 
-	case CAKE_DIFFSERV_DIFFSERV3:
-	default:
-		ft = cake_config_diffserv3(sch);
-		break;
+	sch_tree_lock(sch);
+	if (feedback) {
+		q->feedback_delay_ns = us_to_ns(nla_get_u32(feedback));
+		q->feedback_time = ktime_get();
+		q->feedback_used = false;
 	}
-
-	for (c = q->tin_cnt; c < CAKE_MAX_TINS; c++) {
-		cake_clear_tin(sch, c);
-		q->tins[c].cparams.mtu_time = q->tins[ft].cparams.mtu_time;
+	if (rate) {
+		q->rate_bps = nla_get_u64(rate);
+		cake_configure_rates(sch);
 	}
+	sch_tree_unlock(sch);
 
-	q->rate_ns   = q->tins[ft].tin_rate_ns;
-	q->rate_shft = q->tins[ft].tin_rate_shft;
+	return true;
+}
 
-	if (q->buffer_config_limit) {
-		q->buffer_limit = q->buffer_config_limit;
-	} else if (q->rate_bps) {
-		u64 t = q->rate_bps * q->interval;
+/* Precompute cake_adjust_len() for every length up to the MTU, so framing
+ * compensation costs one load per packet.  Longer packets, or a failed
+ * allocation, fall back to computing it directly.
+ */
+static void cake_build_adjlen_table(struct Qdisc *sch)
+{
+	struct cake_sched_data *q = qdisc_priv(sch);
+	u32 cnt = psched_mtu(qdisc_dev(sch)) + 1;
+	u32 *table, *old;
+	u32 i;
 
-		do_div(t, USEC_PER_SEC / 4);
-		q->buffer_limit = max_t(u32, t, 4U << 20);
+	table = kvzalloc(cnt * sizeof(u32), GFP_KERNEL);
+	if (table) {
+		for (i = 0; i < cnt; i++)
+			table[i] = cake_adjust_len(q, i);
 	} else {
-		q->buffer_limit = ~0;
+		cnt = 0;
 	}
 
-	sch->flags &= ~TCQ_F_CAN_BYPASS;
+	sch_tree_lock(sch);
+	old = q->adjlen_table;
+	q->adjlen_table = table;
+	q->adjlen_cnt = cnt;
+	sch_tree_unlock(sch);
 
-	q->buffer_limit = min(q->buffer_limit,
-			      max(sch->limit * psched_mtu(qdisc_dev(sch)),
-				  q->buffer_config_limit));
+	kvfree(old);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
@@ -2629,12 +4031,23 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 #endif
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
+	bool l4s = q->rate_flags & CAKE_FLAG_L4S;
+	u64 autorate_min = q->autorate_min_bps;
+	u64 autorate_max = q->autorate_max_bps;
+	u32 sce_thresh_us = q->sce_thresh_us;
+	u16 custom_tin_cnt = q->custom_tin_cnt;
+	const u8 *custom_map = q->custom_index;
 	struct nlattr *tb[TCA_CAKE_MAX + 1];
-	int err;
+	struct bpf_prog *prog = NULL;
+	u8 tin_mode = q->tin_mode;
+	int err, i;
 
 	if (!opt)
 		return -EINVAL;
 
+	if (cake_change_rate(sch, opt))
+		return 0;
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
 	err = nla_parse_nested(tb, TCA_CAKE_MAX, opt, cake_policy);
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
@@ -2645,25 +4058,202 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 	if (err < 0)
 		return err;
 
-	if (tb[TCA_CAKE_NAT]) {
-#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
-		q->flow_mode &= ~CAKE_FLOW_NAT_FLAG;
-		q->flow_mode |= CAKE_FLOW_NAT_FLAG *
-			!!nla_get_u32(tb[TCA_CAKE_NAT]);
+	/* validate before anything is applied */
+	if (tb[TCA_CAKE_L4S])
+		l4s = !!nla_get_u32(tb[TCA_CAKE_L4S]);
+
+	if (tb[TCA_CAKE_SCE]) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+		sce_thresh_us = nla_get_u32(tb[TCA_CAKE_SCE]);
+
+		/* kept in 32 bits of nanoseconds, with room for the ramp */
+		if (sce_thresh_us > USEC_PER_SEC)
+			return -EINVAL;
 #else
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	/* SCE and L4S give ECT(1) conflicting meanings */
+	if (sce_thresh_us && l4s)
+		return -EINVAL;
+
+	if (tb[TCA_CAKE_DIFFSERV_MODE])
+		tin_mode = nla_get_u32(tb[TCA_CAKE_DIFFSERV_MODE]);
+
+	if (tb[TCA_CAKE_DSCP_MAP]) {
+		if (nla_len(tb[TCA_CAKE_DSCP_MAP]) != sizeof(q->custom_index))
+			return -EINVAL;
+		custom_map = nla_data(tb[TCA_CAKE_DSCP_MAP]);
+	}
+
+	if (tb[TCA_CAKE_TIN_PARAMS]) {
+		int len = nla_len(tb[TCA_CAKE_TIN_PARAMS]);
+		const struct tc_cake_tin_params *p;
+
+		if (!len || len % sizeof(struct tc_cake_tin_params))
+			return -EINVAL;
+		custom_tin_cnt = len / sizeof(struct tc_cake_tin_params);
+
+		/* a zero fraction would leave the tin unshaped */
+		p = nla_data(tb[TCA_CAKE_TIN_PARAMS]);
+		for (i = 0; i < custom_tin_cnt; i++)
+			if (!p[i].rate_frac ||
+			    p[i].rate_frac > CAKE_RATE_FRAC_ONE ||
+			    !p[i].quantum || p[i].quantum > 65535)
+				return -EINVAL;
+	}
+
+	if (tb[TCA_CAKE_DSCP_MAP] || tb[TCA_CAKE_TIN_PARAMS]) {
+		/* a map needs tins to map to */
+		if (!custom_tin_cnt)
+			return -EINVAL;
+
+		/* every codepoint must land in a configured tin */
+		for (i = 0; i < sizeof(q->custom_index); i++)
+			if (custom_map[i] >= custom_tin_cnt)
+				return -EINVAL;
+	}
+
+	/* the L4S tin must fit after the custom ones */
+	if (l4s && tin_mode == CAKE_DIFFSERV_CUSTOM &&
+	    custom_tin_cnt >= CAKE_MAX_TINS)
+		return -EINVAL;
+
+	if (tb[TCA_CAKE_AUTORATE_MIN64])
+		autorate_min = nla_get_u64(tb[TCA_CAKE_AUTORATE_MIN64]);
+
+	if (tb[TCA_CAKE_AUTORATE_MAX64])
+		autorate_max = nla_get_u64(tb[TCA_CAKE_AUTORATE_MAX64]);
+
+	if (autorate_max && autorate_min > autorate_max)
+		return -EINVAL;
+
+	/* the ingress and egress estimators would fight over rate_bps */
+	if ((tb[TCA_CAKE_AUTORATE] ?
+	     !!nla_get_u32(tb[TCA_CAKE_AUTORATE]) :
+	     !!(q->rate_flags & CAKE_FLAG_AUTORATE_INGRESS)) &&
+	    (tb[TCA_CAKE_AUTORATE_EGRESS] ?
+	     !!nla_get_u32(tb[TCA_CAKE_AUTORATE_EGRESS]) :
+	     !!(q->rate_flags & CAKE_FLAG_AUTORATE_EGRESS)))
+		return -EINVAL;
+
+	if (tb[TCA_CAKE_AUTORATE_ESTIMATOR] &&
+	    nla_get_u32(tb[TCA_CAKE_AUTORATE_ESTIMATOR]) >=
+	    CAKE_AUTORATE_EST_MAX)
+		return -EINVAL;
+
+	if (tb[TCA_CAKE_HOST_MEM_PCT] &&
+	    nla_get_u32(tb[TCA_CAKE_HOST_MEM_PCT]) > 100)
+		return -EINVAL;
+
+	if (tb[TCA_CAKE_TIN_AQM] &&
+	    nla_len(tb[TCA_CAKE_TIN_AQM]) % sizeof(struct tc_cake_tin_aqm))
+		return -EINVAL;
+
+#if !IS_REACHABLE(CONFIG_NF_CONNTRACK)
+	if (tb[TCA_CAKE_NAT]) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
 		NL_SET_ERR_MSG_ATTR(extack, tb[TCA_CAKE_NAT],
 				    "No conntrack support in kernel");
 #endif
 		return -EOPNOTSUPP;
+	}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+	if (tb[TCA_CAKE_BPF_FD])
+		return -EOPNOTSUPP;
+#else
+	/* held until attached below, dropped on any failure before that */
+	if (tb[TCA_CAKE_BPF_FD] && nla_get_s32(tb[TCA_CAKE_BPF_FD]) >= 0) {
+		prog = bpf_prog_get_type(nla_get_s32(tb[TCA_CAKE_BPF_FD]),
+					 BPF_PROG_TYPE_SCHED_CLS);
+		if (IS_ERR(prog)) {
+			NL_SET_ERR_MSG_ATTR(extack, tb[TCA_CAKE_BPF_FD],
+					    "Invalid classifier program");
+			return PTR_ERR(prog);
+		}
+	}
+#endif
+
+	/* Anything that can fail on allocation comes last, once the message
+	 * is known to be valid.  Spare tins are harmless if a later step
+	 * fails, and nothing below this point does.
+	 */
+	if (q->tins) {
+		err = cake_grow_tins(sch, cake_tins_needed(tin_mode,
+							   custom_tin_cnt,
+							   l4s));
+		if (err)
+			goto put_prog;
+
+		/* also gives tins just grown their arrays */
+		if (tb[TCA_CAKE_FLOW_KEYS] ||
+		    q->rate_flags & CAKE_FLAG_FLOW_KEYS) {
+			err = cake_set_flow_keys(sch, tb[TCA_CAKE_FLOW_KEYS] ?
+					!!nla_get_u32(tb[TCA_CAKE_FLOW_KEYS]) :
+					true);
+			if (err)
+				goto put_prog;
+		}
+	}
+
+	if (l4s)
+		q->rate_flags |= CAKE_FLAG_L4S;
+	else
+		q->rate_flags &= ~CAKE_FLAG_L4S;
+	q->sce_thresh_us = sce_thresh_us;
+	q->autorate_min_bps = autorate_min;
+	q->autorate_max_bps = autorate_max;
+
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+	if (tb[TCA_CAKE_NAT]) {
+		q->flow_mode &= ~CAKE_FLOW_NAT_FLAG;
+		q->flow_mode |= CAKE_FLOW_NAT_FLAG *
+			!!nla_get_u32(tb[TCA_CAKE_NAT]);
+	}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	if (tb[TCA_CAKE_BPF_FD]) {
+		struct bpf_prog *old = rtnl_dereference(q->classify_prog);
+
+		rcu_assign_pointer(q->classify_prog, prog);
+		if (old)
+			bpf_prog_put(old);
+	}
 #endif
+
+	if (tb[TCA_CAKE_DSCP_MAP])
+		memcpy(q->custom_index, custom_map, sizeof(q->custom_index));
+
+	if (tb[TCA_CAKE_TIN_PARAMS]) {
+		memcpy(q->custom_tins, nla_data(tb[TCA_CAKE_TIN_PARAMS]),
+		       custom_tin_cnt * sizeof(struct tc_cake_tin_params));
+		q->custom_tin_cnt = custom_tin_cnt;
+	}
+
+	if (tb[TCA_CAKE_HEAD_DROP])
+		q->head_drop_mult = nla_get_u32(tb[TCA_CAKE_HEAD_DROP]);
+
+	if (tb[TCA_CAKE_HOST_MEM_PCT])
+		q->host_mem_pct = nla_get_u32(tb[TCA_CAKE_HOST_MEM_PCT]);
+
+	if (tb[TCA_CAKE_TIN_AQM]) {
+		int len = nla_len(tb[TCA_CAKE_TIN_AQM]);
+
+		q->tin_aqm_cnt = len / sizeof(struct tc_cake_tin_aqm);
+		memcpy(q->tin_aqm, nla_data(tb[TCA_CAKE_TIN_AQM]), len);
 	}
 
 	if (tb[TCA_CAKE_BASE_RATE64])
 		q->rate_bps = nla_get_u64(tb[TCA_CAKE_BASE_RATE64]);
 
-	if (tb[TCA_CAKE_DIFFSERV_MODE])
-		q->tin_mode = nla_get_u32(tb[TCA_CAKE_DIFFSERV_MODE]);
+	if (tb[TCA_CAKE_HOST_RATE64])
+		q->host_rate_bps = nla_get_u64(tb[TCA_CAKE_HOST_RATE64]);
+
+	q->tin_mode = tin_mode;
 
 	if (tb[TCA_CAKE_WASH]) {
 		if (!!nla_get_u32(tb[TCA_CAKE_WASH]))
@@ -2672,6 +4262,25 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 			q->rate_flags &= ~CAKE_FLAG_WASH;
 	}
 
+	if (tb[TCA_CAKE_MEMORY_PEAK_RESET] &&
+	    nla_get_u32(tb[TCA_CAKE_MEMORY_PEAK_RESET]))
+		q->buffer_max_used = q->buffer_used;
+
+	/* before init has allocated the tins, there are no arrays to match */
+	if (tb[TCA_CAKE_FLOW_KEYS] && !q->tins) {
+		if (!!nla_get_u32(tb[TCA_CAKE_FLOW_KEYS]))
+			q->rate_flags |= CAKE_FLAG_FLOW_KEYS;
+		else
+			q->rate_flags &= ~CAKE_FLAG_FLOW_KEYS;
+	}
+
+	if (tb[TCA_CAKE_COMPACT]) {
+		if (!!nla_get_u32(tb[TCA_CAKE_COMPACT]))
+			q->rate_flags |= CAKE_FLAG_COMPACT;
+		else
+			q->rate_flags &= ~CAKE_FLAG_COMPACT;
+	}
+
 	if (tb[TCA_CAKE_FLOW_MODE])
 		q->flow_mode = (q->flow_mode & CAKE_FLOW_NAT_FLAG) |
 			(nla_get_u32(tb[TCA_CAKE_FLOW_MODE]) &
@@ -2723,6 +4332,34 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 			q->rate_flags &= ~CAKE_FLAG_AUTORATE_INGRESS;
 	}
 
+	if (tb[TCA_CAKE_AUTORATE_ESTIMATOR]) {
+		u32 est = nla_get_u32(tb[TCA_CAKE_AUTORATE_ESTIMATOR]);
+
+		if (est != q->autorate_estimator) {
+			memset(q->maxfilt_bw, 0, sizeof(q->maxfilt_bw));
+			q->avg_window_bytes = 0;
+		}
+		q->autorate_estimator = est;
+	}
+
+	if (tb[TCA_CAKE_AUTORATE_EGRESS]) {
+		if (!!nla_get_u32(tb[TCA_CAKE_AUTORATE_EGRESS])) {
+			q->rate_flags |= CAKE_FLAG_AUTORATE_EGRESS;
+			q->egress_period_begin = ktime_get();
+			q->egress_sojourn_min = U64_MAX;
+		} else {
+			q->rate_flags &= ~CAKE_FLAG_AUTORATE_EGRESS;
+		}
+	}
+
+	if (tb[TCA_CAKE_AUTORATE_FEEDBACK_US]) {
+		u32 fb = nla_get_u32(tb[TCA_CAKE_AUTORATE_FEEDBACK_US]);
+
+		q->feedback_delay_ns = us_to_ns(fb);
+		q->feedback_time = ktime_get();
+		q->feedback_used = false;
+	}
+
 	if (tb[TCA_CAKE_INGRESS]) {
 		if (!!nla_get_u32(tb[TCA_CAKE_INGRESS]))
 			q->rate_flags |= CAKE_FLAG_INGRESS;
@@ -2737,10 +4374,17 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 		q->buffer_config_limit = nla_get_u32(tb[TCA_CAKE_MEMORY]);
 
 	if (tb[TCA_CAKE_SPLIT_GSO]) {
-		if (!!nla_get_u32(tb[TCA_CAKE_SPLIT_GSO]))
+		u32 split = nla_get_u32(tb[TCA_CAKE_SPLIT_GSO]);
+
+		q->rate_flags &= ~(CAKE_FLAG_SPLIT_GSO |
+				   CAKE_FLAG_SPLIT_GSO_LAZY |
+				   CAKE_FLAG_SPLIT_GSO_AUTO);
+		if (split == CAKE_SPLIT_GSO_DEQUEUE)
+			q->rate_flags |= CAKE_FLAG_SPLIT_GSO_LAZY;
+		else if (split == CAKE_SPLIT_GSO_AUTO)
+			q->rate_flags |= CAKE_FLAG_SPLIT_GSO_AUTO;
+		else if (split)
 			q->rate_flags |= CAKE_FLAG_SPLIT_GSO;
-		else
-			q->rate_flags &= ~CAKE_FLAG_SPLIT_GSO;
 	}
 
 	if (tb[TCA_CAKE_FWMARK]) {
@@ -2748,6 +4392,11 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 		q->fwmark_shft = q->fwmark_mask ? __ffs(q->fwmark_mask) : 0;
 	}
 
+	if (!q->adjlen_table || tb[TCA_CAKE_ATM] || tb[TCA_CAKE_OVERHEAD] ||
+	    tb[TCA_CAKE_MPU] ||
+	    q->adjlen_cnt != psched_mtu(qdisc_dev(sch)) + 1)
+		cake_build_adjlen_table(sch);
+
 	if (q->tins) {
 		sch_tree_lock(sch);
 		cake_reconfigure(sch);
@@ -2755,11 +4404,17 @@ static int cake_change(struct Qdisc *sch, struct nlattr *opt,
 	}
 
 	return 0;
+
+put_prog:
+	if (prog)
+		bpf_prog_put(prog);
+	return err;
 }
 
 static void cake_destroy(struct Qdisc *sch)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
+	int i;
 
 	qdisc_watchdog_cancel(&q->watchdog);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
@@ -2767,7 +4422,18 @@ static void cake_destroy(struct Qdisc *sch)
 #else
 	tcf_block_put(q->block);
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	if (rcu_access_pointer(q->classify_prog))
+		bpf_prog_put(rtnl_dereference(q->classify_prog));
+#endif
+	if (q->tins) {
+		for (i = 0; i < q->tin_alloc; i++)
+			kvfree(q->tins[i].flow_keys);
+	}
 	kvfree(q->tins);
+	kvfree(q->hosts);
+	kvfree(q->overflow_heap);
+	kvfree(q->adjlen_table);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
@@ -2778,7 +4444,7 @@ static int cake_init(struct Qdisc *sch, struct nlattr *opt,
 #endif
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
-	int i, j, err;
+	int i, err;
 
 	sch->limit = 10240;
 	q->tin_mode = CAKE_DIFFSERV_DIFFSERV3;
@@ -2823,34 +4489,23 @@ static int cake_init(struct Qdisc *sch, struct nlattr *opt,
 	for (i = 1; i <= CAKE_QUEUES; i++)
 		quantum_div[i] = 65535 / i;
 
-	q->tins = kvzalloc(CAKE_MAX_TINS * sizeof(struct cake_tin_data),
+	q->tin_alloc = cake_tins_needed(q->tin_mode, q->custom_tin_cnt,
+					q->rate_flags & CAKE_FLAG_L4S);
+	q->tins = kvzalloc(q->tin_alloc * sizeof(struct cake_tin_data),
 			   GFP_KERNEL);
-	if (!q->tins)
+	q->overflow_heap = kvzalloc(q->tin_alloc * CAKE_QUEUES *
+				    sizeof(struct cake_heap_entry),
+				    GFP_KERNEL);
+	q->hosts = kvzalloc(CAKE_HOSTS * sizeof(struct cake_host), GFP_KERNEL);
+	if (!q->tins || !q->overflow_heap || !q->hosts)
 		goto nomem;
 
-	for (i = 0; i < CAKE_MAX_TINS; i++) {
-		struct cake_tin_data *b = q->tins + i;
+	q->host_perturb = prandom_u32();
+	for (i = 0; i < q->tin_alloc; i++)
+		cake_init_tin(q, q->tins + i, q->overflow_heap, i);
 
-		b->perturb = prandom_u32();
-		INIT_LIST_HEAD(&b->new_flows);
-		INIT_LIST_HEAD(&b->old_flows);
-		INIT_LIST_HEAD(&b->decaying_flows);
-		b->sparse_flow_count = 0;
-		b->bulk_flow_count = 0;
-		b->decaying_flow_count = 0;
-
-		for (j = 0; j < CAKE_QUEUES; j++) {
-			struct cake_flow *flow = b->flows + j;
-			u32 k = j * CAKE_MAX_TINS + i;
-
-			INIT_LIST_HEAD(&flow->flowchain);
-			cobalt_vars_init(&flow->cvars);
-
-			q->overflow_heap[k].t = i;
-			q->overflow_heap[k].b = j;
-			b->overflow_idx[j] = k;
-		}
-	}
+	if (cake_set_flow_keys(sch, q->rate_flags & CAKE_FLAG_FLOW_KEYS))
+		goto nomem;
 
 	cake_reconfigure(sch);
 	q->avg_peak_bandwidth = q->rate_bps;
@@ -2867,6 +4522,7 @@ static int cake_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
 	struct nlattr *opts;
+	u32 split;
 
 	opts = nla_nest_start(skb, TCA_OPTIONS);
 	if (!opts)
@@ -2880,6 +4536,11 @@ static int cake_dump(struct Qdisc *sch, struct sk_buff *skb)
 			q->flow_mode & CAKE_FLOW_MASK))
 		goto nla_put_failure;
 
+	if (q->host_rate_bps &&
+	    nla_put_u64_64bit(skb, TCA_CAKE_HOST_RATE64, q->host_rate_bps,
+			      TCA_CAKE_PAD))
+		goto nla_put_failure;
+
 	if (nla_put_u32(skb, TCA_CAKE_RTT, q->interval))
 		goto nla_put_failure;
 
@@ -2893,6 +4554,24 @@ static int cake_dump(struct Qdisc *sch, struct sk_buff *skb)
 			!!(q->rate_flags & CAKE_FLAG_AUTORATE_INGRESS)))
 		goto nla_put_failure;
 
+	if (nla_put_u32(skb, TCA_CAKE_AUTORATE_ESTIMATOR,
+			q->autorate_estimator))
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, TCA_CAKE_AUTORATE_EGRESS,
+			!!(q->rate_flags & CAKE_FLAG_AUTORATE_EGRESS)))
+		goto nla_put_failure;
+
+	if (q->autorate_min_bps &&
+	    nla_put_u64_64bit(skb, TCA_CAKE_AUTORATE_MIN64,
+			      q->autorate_min_bps, TCA_CAKE_PAD))
+		goto nla_put_failure;
+
+	if (q->autorate_max_bps &&
+	    nla_put_u64_64bit(skb, TCA_CAKE_AUTORATE_MAX64,
+			      q->autorate_max_bps, TCA_CAKE_PAD))
+		goto nla_put_failure;
+
 	if (nla_put_u32(skb, TCA_CAKE_INGRESS,
 			!!(q->rate_flags & CAKE_FLAG_INGRESS)))
 		goto nla_put_failure;
@@ -2911,6 +4590,21 @@ static int cake_dump(struct Qdisc *sch, struct sk_buff *skb)
 			!!(q->rate_flags & CAKE_FLAG_WASH)))
 		goto nla_put_failure;
 
+	if (nla_put_u32(skb, TCA_CAKE_L4S,
+			!!(q->rate_flags & CAKE_FLAG_L4S)))
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, TCA_CAKE_FLOW_KEYS,
+			!!(q->rate_flags & CAKE_FLAG_FLOW_KEYS)))
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, TCA_CAKE_COMPACT,
+			!!(q->rate_flags & CAKE_FLAG_COMPACT)))
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, TCA_CAKE_SCE, q->sce_thresh_us))
+		goto nla_put_failure;
+
 	if (nla_put_u32(skb, TCA_CAKE_OVERHEAD, q->rate_overhead))
 		goto nla_put_failure;
 
@@ -2924,19 +4618,210 @@ static int cake_dump(struct Qdisc *sch, struct sk_buff *skb)
 	if (nla_put_u32(skb, TCA_CAKE_MPU, q->rate_mpu))
 		goto nla_put_failure;
 
-	if (nla_put_u32(skb, TCA_CAKE_SPLIT_GSO,
-			!!(q->rate_flags & CAKE_FLAG_SPLIT_GSO)))
+	if (q->rate_flags & CAKE_FLAG_SPLIT_GSO_AUTO)
+		split = CAKE_SPLIT_GSO_AUTO;
+	else if (q->rate_flags & CAKE_FLAG_SPLIT_GSO_LAZY)
+		split = CAKE_SPLIT_GSO_DEQUEUE;
+	else
+		split = !!(q->rate_flags & CAKE_FLAG_SPLIT_GSO);
+
+	if (nla_put_u32(skb, TCA_CAKE_SPLIT_GSO, split))
 		goto nla_put_failure;
 
 	if (nla_put_u32(skb, TCA_CAKE_FWMARK, q->fwmark_mask))
 		goto nla_put_failure;
 
+	if (q->custom_tin_cnt) {
+		if (nla_put(skb, TCA_CAKE_DSCP_MAP, sizeof(q->custom_index),
+			    q->custom_index))
+			goto nla_put_failure;
+
+		if (nla_put(skb, TCA_CAKE_TIN_PARAMS,
+			    q->custom_tin_cnt *
+			    sizeof(struct tc_cake_tin_params),
+			    q->custom_tins))
+			goto nla_put_failure;
+	}
+
+	if (nla_put_u32(skb, TCA_CAKE_HEAD_DROP, q->head_drop_mult))
+		goto nla_put_failure;
+
+	if (nla_put_u32(skb, TCA_CAKE_HOST_MEM_PCT, q->host_mem_pct))
+		goto nla_put_failure;
+
+	if (q->tin_aqm_cnt &&
+	    nla_put(skb, TCA_CAKE_TIN_AQM,
+		    q->tin_aqm_cnt * sizeof(struct tc_cake_tin_aqm),
+		    q->tin_aqm))
+		goto nla_put_failure;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+	if (rcu_access_pointer(q->classify_prog)) {
+		struct bpf_prog *prog = rtnl_dereference(q->classify_prog);
+
+		if (nla_put_u32(skb, TCA_CAKE_BPF_ID, prog->aux->id))
+			goto nla_put_failure;
+	}
+#endif
+
 	return nla_nest_end(skb, opts);
 
 nla_put_failure:
 	return -1;
 }
 
+/* Sort a copy of the candidates of @t by usage, largest first, leaving out
+ * those that have drained.  The dump runs without the qdisc lock, so @t is
+ * only read; a candidate changing meanwhile just reports a slightly old value.
+ */
+static int cake_mem_top_sort(const struct cake_mem_top *t, u16 *key, u32 *mem)
+{
+	int i, k, n = 0, cnt = min_t(int, READ_ONCE(t->cnt),
+				     CAKE_MEM_TOP_FLOWS);
+	u32 m;
+
+	for (i = 0; i < cnt; i++) {
+		m = READ_ONCE(t->mem[i]);
+		if (!m)
+			continue;
+
+		for (k = n++; k > 0 && mem[k - 1] < m; k--) {
+			mem[k] = mem[k - 1];
+			key[k] = key[k - 1];
+		}
+		mem[k] = m;
+		key[k] = READ_ONCE(t->key[i]);
+	}
+
+	return n;
+}
+
+/* Report the flows and hosts holding the most memory, so operators can see
+ * who drives memory pressure without walking every class.  Flows are given
+ * by class id, hosts by their tag.
+ */
+static int cake_dump_mem_top(struct cake_sched_data *q, struct sk_buff *skb)
+{
+	u32 mem[CAKE_MEM_TOP_FLOWS];
+	u16 key[CAKE_MEM_TOP_FLOWS];
+	struct nlattr *top, *fs;
+	int i, k, n, e = 0;
+
+	n = cake_mem_top_sort(&q->mem_top_flows, key, mem);
+
+	top = nla_nest_start(skb, TCA_CAKE_STATS_MEM_TOP_FLOWS);
+	if (!top)
+		return -1;
+
+	for (k = 0; k < n; k++) {
+		u16 tin = key[k] / CAKE_QUEUES, j = key[k] % CAKE_QUEUES;
+
+		/* class ids follow the priority order of the tins */
+		for (i = 0; i < q->tin_cnt && q->tin_order[i] != tin; i++)
+			;
+		if (i == q->tin_cnt)
+			continue;
+
+		fs = nla_nest_start(skb, ++e);
+		if (!fs ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_FLOW_CLASSID,
+				i * CAKE_QUEUES + j + 1) ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_FLOW_MEMORY, mem[k]) ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_FLOW_BACKLOG,
+				q->tins[tin].backlogs[j]))
+			return -1;
+		nla_nest_end(skb, fs);
+	}
+	nla_nest_end(skb, top);
+
+	n = cake_mem_top_sort(&q->mem_top_hosts, key, mem);
+
+	top = nla_nest_start(skb, TCA_CAKE_STATS_MEM_TOP_HOSTS);
+	if (!top)
+		return -1;
+
+	for (k = 0; k < n; k++) {
+		const struct cake_host *h = &q->hosts[key[k] & ~CAKE_MEM_TOP_DST];
+		bool dst = key[k] & CAKE_MEM_TOP_DST;
+
+		fs = nla_nest_start(skb, k + 1);
+		if (!fs ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_HOST_TAG,
+				dst ? h->dsthost_tag : h->srchost_tag) ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_HOST_DST, dst) ||
+		    nla_put_u32(skb, TCA_CAKE_MEM_HOST_MEMORY, mem[k]))
+			return -1;
+		nla_nest_end(skb, fs);
+	}
+	nla_nest_end(skb, top);
+
+	return 0;
+}
+
+/* Report a tin's heavy hitters, largest first, with the tags identifying the
+ * flow and its hosts, so bulk flows can be found without a class walk.
+ */
+static int cake_dump_heavy(struct cake_sched_data *q,
+			   const struct cake_tin_data *b, int tin,
+			   struct sk_buff *skb)
+{
+	const struct cake_heavy_entry *e, *order[CAKE_HEAVY_FLOWS];
+	u32 bytes, shift = cake_heavy_shift(b, ktime_get());
+	struct nlattr *flows, *fs;
+	int i, k, n = 0;
+
+	for (i = 0; i < b->heavy_cnt; i++) {
+		e = &b->heavy[i];
+		for (k = i; k > 0 && order[k - 1]->bytes < e->bytes; k--)
+			order[k] = order[k - 1];
+		order[k] = e;
+	}
+
+	flows = nla_nest_start(skb, TCA_CAKE_TIN_STATS_HEAVY_FLOWS);
+	if (!flows)
+		return -1;
+
+	for (k = 0; k < b->heavy_cnt; k++) {
+		const struct cake_flow *flow;
+
+		e = order[k];
+		flow = &b->flows[e->flow];
+
+		/* halvings owed since the last update are applied here only,
+		 * as the dump does not hold the qdisc lock
+		 */
+		bytes = cake_heavy_bytes(e->bytes, shift);
+
+		/* the slot has been reused and nothing recent was counted */
+		if (b->tags[e->flow] != e->tag && !bytes)
+			continue;
+
+		fs = nla_nest_start(skb, ++n);
+		if (!fs ||
+		    nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_CLASSID,
+				tin * CAKE_QUEUES + e->flow + 1) ||
+		    nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_TAG, e->tag) ||
+		    nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_BYTES, bytes) ||
+		    nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_BACKLOG,
+				b->tags[e->flow] == e->tag ?
+				b->backlogs[e->flow] : 0))
+			return -1;
+
+		if (b->tags[e->flow] == e->tag &&
+		    ((cake_dsrc(q->flow_mode) &&
+		      nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_SRCHOST_TAG,
+				  b->hosts[flow->srchost].srchost_tag)) ||
+		     (cake_ddst(q->flow_mode) &&
+		      nla_put_u32(skb, TCA_CAKE_HEAVY_FLOW_DSTHOST_TAG,
+				  b->hosts[flow->dsthost].dsthost_tag))))
+			return -1;
+		nla_nest_end(skb, fs);
+	}
+
+	nla_nest_end(skb, flows);
+	return 0;
+}
+
 static int cake_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 {
 	struct nlattr *stats = nla_nest_start(d->skb, TCA_STATS_APP);
@@ -2960,11 +4845,18 @@ static int cake_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 	PUT_STAT_U64(CAPACITY_ESTIMATE64, q->avg_peak_bandwidth);
 	PUT_STAT_U32(MEMORY_LIMIT, q->buffer_limit);
 	PUT_STAT_U32(MEMORY_USED, q->buffer_max_used);
+	PUT_STAT_U32(MEMORY_CURRENT, q->buffer_used);
 	PUT_STAT_U32(AVG_NETOFF, ((q->avg_netoff + 0x8000) >> 16));
 	PUT_STAT_U32(MAX_NETLEN, q->max_netlen);
 	PUT_STAT_U32(MAX_ADJLEN, q->max_adjlen);
 	PUT_STAT_U32(MIN_NETLEN, q->min_netlen);
 	PUT_STAT_U32(MIN_ADJLEN, q->min_adjlen);
+	PUT_STAT_U32(COMPACTED, q->compacted);
+	/* memory charged per byte queued, in percent */
+	PUT_STAT_U32(TRUESIZE_PCT,
+		     sch->qstats.backlog ?
+		     div_u64((u64)q->buffer_used * 100, sch->qstats.backlog) :
+		     0);
 
 #undef PUT_STAT_U32
 #undef PUT_STAT_U64
@@ -3002,6 +4894,8 @@ static int cake_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 		PUT_TSTAT_U32(SENT_PACKETS, b->packets);
 		PUT_TSTAT_U32(DROPPED_PACKETS, b->tin_dropped);
 		PUT_TSTAT_U32(ECN_MARKED_PACKETS, b->tin_ecn_mark);
+		PUT_TSTAT_U32(SCE_MARKED_PACKETS, b->tin_sce_mark);
+		PUT_TSTAT_U32(HEAD_DROPPED_PACKETS, b->head_drops);
 		PUT_TSTAT_U32(ACKS_DROPPED_PACKETS, b->ack_drops);
 
 		PUT_TSTAT_U32(PEAK_DELAY_US,
@@ -3015,13 +4909,16 @@ static int cake_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 		PUT_TSTAT_U32(WAY_MISSES, b->way_misses);
 		PUT_TSTAT_U32(WAY_COLLISIONS, b->way_collisions);
 
-		PUT_TSTAT_U32(SPARSE_FLOWS, b->sparse_flow_count +
-					    b->decaying_flow_count);
+		PUT_TSTAT_U32(SPARSE_FLOWS, b->sparse_flow_count);
 		PUT_TSTAT_U32(BULK_FLOWS, b->bulk_flow_count);
 		PUT_TSTAT_U32(UNRESPONSIVE_FLOWS, b->unresponsive_flow_count);
 		PUT_TSTAT_U32(MAX_SKBLEN, b->max_skblen);
 
 		PUT_TSTAT_U32(FLOW_QUANTUM, b->flow_quantum);
+		PUT_TSTAT_U32(MEMORY_USED, b->tin_mem);
+
+		if (cake_dump_heavy(q, b, i, d->skb))
+			goto nla_put_failure;
 		nla_nest_end(d->skb, ts);
 	}
 
@@ -3029,6 +4926,10 @@ static int cake_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 #undef PUT_TSTAT_U64
 
 	nla_nest_end(d->skb, tstats);
+
+	if (cake_dump_mem_top(q, d->skb))
+		goto nla_put_failure;
+
 	return nla_nest_end(d->skb, stats);
 
 nla_put_failure:
@@ -3089,6 +4990,7 @@ static int cake_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 				 struct gnet_dump *d)
 {
 	struct cake_sched_data *q = qdisc_priv(sch);
+	const struct tc_cake_flow_key *key = NULL;
 	const struct cake_flow *flow = NULL;
 	struct gnet_stats_queue qs = { 0 };
 	struct nlattr *stats;
@@ -3101,6 +5003,9 @@ static int cake_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 
 		flow = &b->flows[idx % CAKE_QUEUES];
 
+		if (b->flow_keys && b->flow_keys[idx % CAKE_QUEUES].ip_version)
+			key = &b->flow_keys[idx % CAKE_QUEUES];
+
 		if (flow->head) {
 			cake_maybe_lock(sch);
 			skb = flow->head;
@@ -3146,6 +5051,9 @@ static int cake_dump_class_stats(struct Qdisc *sch, unsigned long cl,
 					     ktime_sub(now,
 						       flow->cvars.drop_next)));
 		}
+		if (key &&
+		    nla_put(d->skb, TCA_CAKE_STATS_FLOW_KEY, sizeof(*key), key))
+			goto nla_put_failure;
 
 		if (nla_nest_end(d->skb, stats) < 0)
 			return -1;
@@ -3212,7 +5120,7 @@ static struct Qdisc_ops cake_qdisc_ops __read_mostly = {
 	.dequeue	=	cake_dequeue,
 	.peek		=	qdisc_peek_dequeued,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-	.drop		=	cake_drop,
+	.drop		=	cake_drop_op,
 #endif
 	.init		=	cake_init,
 	.reset		=	cake_reset,